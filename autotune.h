@@ -0,0 +1,158 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "Halide.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace Halide;
+
+// A schedule is a point in a discrete search space: params[i] is one of
+// choices[i]. Pipelines convert their schedule structs to and from this form.
+using ScheduleParams = std::vector<int>;
+
+struct ScheduleSpace {
+    std::vector<std::string> names;
+    std::vector<std::vector<int>> choices;
+};
+
+// true if params has one value per knob of `space`, each among its choices
+inline bool in_space(const ScheduleSpace &space, const ScheduleParams &params) {
+    if (params.size() != space.names.size() || params.size() != space.choices.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < params.size(); i++) {
+        const std::vector<int> &c = space.choices[i];
+        if (std::find(c.begin(), c.end(), params[i]) == c.end()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline std::string describe(const ScheduleSpace &space, const ScheduleParams &params) {
+    std::ostringstream s;
+    for (size_t i = 0; i < params.size() && i < space.names.size(); i++) {
+        s << (i ? " " : "") << space.names[i] << '=' << params[i];
+    }
+    return s.str();
+}
+
+// Cache key of a tuned schedule: kernel name, problem dimensions and target.
+inline std::string schedule_key(const std::string &kernel, const std::vector<int> &dims, const Target &target) {
+    std::ostringstream key;
+    key << kernel;
+    for (int d : dims) {
+        key << ',' << d;
+    }
+    key << '/' << target.to_string();
+    return key.str();
+}
+
+// On-disk cache of tuned schedules, one "<key> <time> <params...>" line per
+// entry. Later lines override earlier ones, so store() only appends.
+class ScheduleCache {
+ public:
+    explicit ScheduleCache(const std::string &path) : path(path) {
+        std::ifstream f(path);
+        std::string line;
+        while (std::getline(f, line)) {
+            std::istringstream fields(line);
+            std::string key;
+            double time;
+            if (!(fields >> key >> time)) {
+                continue;
+            }
+            ScheduleParams params;
+            int p;
+            while (fields >> p) {
+                params.push_back(p);
+            }
+            entries[key] = params;
+        }
+    }
+
+    // An entry written for another version of the search space (other knobs
+    // or choices) is ignored, so the caller falls back to its default.
+    bool lookup(const std::string &key, const ScheduleSpace &space, ScheduleParams &params) const {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return false;
+        }
+        if (!in_space(space, it->second)) {
+            printf("%s: ignoring the stale schedule of %s\n", path.c_str(), key.c_str());
+            return false;
+        }
+        params = it->second;
+        return true;
+    }
+
+    void store(const std::string &key, const ScheduleParams &params, double time) {
+        entries[key] = params;
+        std::ofstream f(path, std::ios::app);
+        f << key << ' ' << time;
+        for (int p : params) {
+            f << ' ' << p;
+        }
+        f << '\n';
+    }
+
+ private:
+    std::string path;
+    std::map<std::string, ScheduleParams> entries;
+};
+
+// Greedy coordinate descent: sweeps one parameter at a time over all of its
+// choices with the others fixed, keeps the fastest, and repeats until a full
+// pass brings no improvement or `max_trials` candidates were timed. `cost`
+// returns the runtime of a candidate, or infinity if it failed to compile.
+inline ScheduleParams coordinate_descent(const ScheduleSpace &space, ScheduleParams best,
+                                         const std::function<double(const ScheduleParams &)> &cost,
+                                         int max_trials, double *best_time = nullptr) {
+    std::map<ScheduleParams, double> timed;
+    auto evaluate = [&](const ScheduleParams &params) {
+        auto it = timed.find(params);
+        if (it != timed.end()) {
+            return it->second;
+        }
+        double t = cost(params);
+        timed[params] = t;
+        printf("  [%zu/%d] %s: %fms\n", timed.size(), max_trials, describe(space, params).c_str(), t * 1e3);
+        return t;
+    };
+
+    double t_best = evaluate(best);
+    bool improved = true;
+    while (improved && (int)timed.size() < max_trials) {
+        improved = false;
+        for (size_t i = 0; i < space.choices.size() && (int)timed.size() < max_trials; i++) {
+            for (int choice : space.choices[i]) {
+                if ((int)timed.size() >= max_trials) {
+                    break;
+                }
+                ScheduleParams candidate = best;
+                candidate[i] = choice;
+                double t = evaluate(candidate);
+                if (t < t_best) {
+                    t_best = t;
+                    best = candidate;
+                    improved = true;
+                }
+            }
+        }
+    }
+    if (best_time) {
+        *best_time = t_best;
+    }
+    return best;
+}
+
+#endif
@@ -0,0 +1,319 @@
+#include "Halide.h"
+#include "common.h"
+#include "dilated_conv_s2b_pipeline.h"
+#include "perf_counters.h"
+#include "pool_allocator.h"
+#include "threading.h"
+#include "halide_conv.h"
+#include "halide_dilated_conv.h"
+#include "halide_dilated_conv_s2b.h"
+#include "halide_matmul.h"
+#include "halide_op_fuse.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace Halide;
+using namespace Halide::Tools;
+
+// Sweeps the AOT Halide kernels and their oneDNN baselines over shapes and
+// dilations, timing everything with the adaptive benchmark, and writes one
+// record per (kernel, implementation, shape, dilation) as CSV and/or JSON.
+// Both thread pools are sized by --threads (see threading.h); `make bench`
+// runs the sweep once per entry of BENCH_THREADS. --scaling instead times
+// every case from 1 thread up to --threads within one process, and adds the
+// speedup and parallel efficiency over the 1 thread run to each record.
+
+struct BenchRecord {
+    std::string kernel, impl, algo, shape;
+    int DW, DH, threads;
+    BenchmarkResult result;
+    double gflops;
+    float max_abs_error;
+    PerfSample counters;
+    // relative to the first thread count of a --scaling sweep, 0 otherwise
+    double speedup = 0, efficiency = 0;
+};
+
+// Runs `op` under the adaptive benchmark and keeps the whole result, plus
+// its hardware counters when they are enabled.
+struct AdaptiveTimer {
+    BenchmarkConfig config;
+    bool counters = false;
+    BenchmarkResult last = {};
+    PerfSample last_counters;
+
+    double operator()(const std::function<void()> &op) {
+        last = benchmark(op, config);
+        last_counters = counters ? measure_counters(op) : PerfSample();
+        return last.wall_time;
+    }
+};
+
+// Counter columns: IPC and misses per analytic FLOP, `na` when unavailable.
+const char *counter_names[] = {"ipc", "l1d_misses_per_flop", "llc_misses_per_flop", "dtlb_misses_per_flop"};
+
+std::vector<std::string> counter_fields(const BenchRecord &r, const char *na) {
+    const PerfSample &s = r.counters;
+    double flops = r.gflops * 1e9;
+    auto field = [&](bool valid, double v) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%g", v);
+        return valid ? std::string(buf) : std::string(na);
+    };
+    return {field(s.has(PERF_CYCLES) && s.has(PERF_INSTRUCTIONS), s.value[PERF_INSTRUCTIONS] / s.value[PERF_CYCLES]),
+            field(s.has(PERF_L1D_MISSES), s.value[PERF_L1D_MISSES] / flops),
+            field(s.has(PERF_LLC_MISSES), s.value[PERF_LLC_MISSES] / flops),
+            field(s.has(PERF_DTLB_MISSES), s.value[PERF_DTLB_MISSES] / flops)};
+}
+
+// Speedup and efficiency columns, `na` outside of a scaling sweep.
+std::string scaling_field(double v, const char *na) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", v);
+    return v > 0 ? std::string(buf) : std::string(na);
+}
+
+// Sum of two timings, e.g. the separate oneDNN conv and batchnorm primitives.
+BenchmarkResult combine(const BenchmarkResult &a, const BenchmarkResult &b) {
+    return {a.wall_time + b.wall_time, std::min(a.samples, b.samples),
+            a.iterations + b.iterations, std::max(a.accuracy, b.accuracy)};
+}
+
+std::vector<std::string> split(const std::string &s, char sep) {
+    std::vector<std::string> parts;
+    std::istringstream in(s);
+    std::string part;
+    while (std::getline(in, part, sep)) {
+        if (!part.empty()) {
+            parts.push_back(part);
+        }
+    }
+    return parts;
+}
+
+void write_csv(const std::string &path, const std::vector<BenchRecord> &records) {
+    // append, so that runs with different thread counts share one file
+    bool exists = std::ifstream(path).good();
+    FILE *f = fopen(path.c_str(), "a");
+    if (!f) {
+        printf("cannot write %s\n", path.c_str());
+        return;
+    }
+    if (!exists) {
+        fprintf(f, "kernel,impl,algo,shape,DW,DH,threads,time_ms,gflops_per_s,samples,iterations,timing_accuracy,max_abs_error,speedup,efficiency");
+        for (const char *name : counter_names) {
+            fprintf(f, ",%s", name);
+        }
+        fprintf(f, "\n");
+    }
+    for (const BenchRecord &r : records) {
+        fprintf(f, "%s,%s,%s,\"%s\",%d,%d,%d,%f,%f,%llu,%llu,%f,%g,%s,%s",
+                r.kernel.c_str(), r.impl.c_str(), r.algo.c_str(), r.shape.c_str(), r.DW, r.DH, r.threads,
+                r.result.wall_time * 1e3, r.gflops / r.result.wall_time,
+                (unsigned long long)r.result.samples, (unsigned long long)r.result.iterations,
+                r.result.accuracy, r.max_abs_error,
+                scaling_field(r.speedup, "").c_str(), scaling_field(r.efficiency, "").c_str());
+        for (const std::string &field : counter_fields(r, "")) {
+            fprintf(f, ",%s", field.c_str());
+        }
+        fprintf(f, "\n");
+    }
+    fclose(f);
+}
+
+void write_json(const std::string &path, const std::vector<BenchRecord> &records) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        printf("cannot write %s\n", path.c_str());
+        return;
+    }
+    fprintf(f, "[\n");
+    for (size_t i = 0; i < records.size(); i++) {
+        const BenchRecord &r = records[i];
+        fprintf(f, "  {\"kernel\": \"%s\", \"impl\": \"%s\", \"algo\": \"%s\", \"shape\": \"%s\", "
+                   "\"DW\": %d, \"DH\": %d, \"threads\": %d, \"time_ms\": %f, \"gflops_per_s\": %f, "
+                   "\"samples\": %llu, \"iterations\": %llu, \"timing_accuracy\": %f, \"max_abs_error\": %g, "
+                   "\"speedup\": %s, \"efficiency\": %s",
+                r.kernel.c_str(), r.impl.c_str(), r.algo.c_str(), r.shape.c_str(), r.DW, r.DH, r.threads,
+                r.result.wall_time * 1e3, r.gflops / r.result.wall_time,
+                (unsigned long long)r.result.samples, (unsigned long long)r.result.iterations,
+                r.result.accuracy, r.max_abs_error,
+                scaling_field(r.speedup, "null").c_str(), scaling_field(r.efficiency, "null").c_str());
+        std::vector<std::string> fields = counter_fields(r, "null");
+        for (size_t k = 0; k < fields.size(); k++) {
+            fprintf(f, ", \"%s\": %s", counter_names[k], fields[k].c_str());
+        }
+        fprintf(f, "}%s\n", i + 1 < records.size() ? "," : "");
+    }
+    fprintf(f, "]\n");
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    const std::string csv = take_option(argc, argv, "--csv", "");
+    const std::string json = take_option(argc, argv, "--json", "");
+    const auto kernels = split(take_option(argc, argv, "--kernels", "matmul,conv,dilated_conv,op_fuse"), ',');
+    const auto shapes = split(take_option(argc, argv, "--shapes", "5,128,128,100,80,3,3;1,64,64,56,56,3,3"), ';');
+    const auto dilations = split(take_option(argc, argv, "--dilations", "0,1,15,31,63"), ',');
+    ThreadConfig threading;
+    if (!take_threading(argc, argv, threading)) {
+        return 1;
+    }
+    print_threading(threading);
+    // --alloc system|pool|huge picks the allocator of the Halide intermediates (see pool_allocator.h)
+    if (!take_allocator(argc, argv)) {
+        return 1;
+    }
+    // --scaling sweeps 1, 2, 4, ... threads up to --threads
+    const std::vector<int> thread_counts =
+        take_flag(argc, argv, "--scaling") ? scaling_thread_counts(threading.threads) : std::vector<int>{threading.threads};
+
+    AdaptiveTimer timer;
+    timer.config.min_time = atof(take_option(argc, argv, "--min-time", "0.1"));
+    timer.config.max_time = timer.config.min_time * 4;
+    timer.config.accuracy = atof(take_option(argc, argv, "--accuracy", "0.03"));
+    // --counters adds IPC and misses per FLOP (perf_event_open) to every record
+    timer.counters = take_flag(argc, argv, "--counters");
+    // by reference, so timer.last holds the result after each wrapper call
+    auto time_dnnl = [&](const std::function<void()> &op) { return timer(op); };
+    const float epsilon = 1.e-9f;
+
+    std::vector<BenchRecord> records;
+    // first time of every case in a scaling sweep, keyed by everything but the thread count
+    std::map<std::string, std::pair<int, double>> scaling_base;
+    auto report = [&](BenchRecord r) {
+        if (thread_counts.size() > 1) {
+            std::string key = r.kernel + "/" + r.impl + "/" + r.algo + "/" + r.shape + "/" +
+                              std::to_string(r.DW) + "/" + std::to_string(r.DH);
+            auto base = scaling_base.emplace(key, std::make_pair(r.threads, r.result.wall_time)).first->second;
+            r.speedup = base.second / r.result.wall_time;
+            r.efficiency = r.speedup * base.first / r.threads;
+        }
+        printf("%-12s %-7s %-6s %-22s %3d x %-3d %2d threads: %10.4fms %8.2f GFLOP/s (%llu samples, %.3f accuracy, err %g)\n",
+               r.kernel.c_str(), r.impl.c_str(), r.algo.c_str(), r.shape.c_str(), r.DW, r.DH, r.threads,
+               r.result.wall_time * 1e3, r.gflops / r.result.wall_time,
+               (unsigned long long)r.result.samples, r.result.accuracy, r.max_abs_error);
+        if (r.speedup > 0) {
+            printf("%-12s %-7s speedup %.2fx, parallel efficiency %.0f%%\n", "", "", r.speedup, 100 * r.efficiency);
+        }
+        records.push_back(r);
+    };
+
+    for (const std::string &kernel : kernels) {
+        if (kernel == "matmul") {
+            // the matmul kernel is compiled for a fixed size
+            const int matrix_size = 992;
+            Buffer<float, 2> mat_A(matrix_size, matrix_size);
+            Buffer<float, 2> mat_B(matrix_size, matrix_size);
+            Buffer<float, 2> output_halide(matrix_size, matrix_size);
+            Buffer<float, 2> output_ref(matrix_size, matrix_size);
+            random_data<float, 2>(mat_A);
+            random_data<float, 2>(mat_B);
+
+            for (int threads : thread_counts) {
+                use_threads(threading, threads);
+                timer([&]() {
+                    halide_matmul(mat_A.raw_buffer(), mat_B.raw_buffer(), output_halide.raw_buffer());
+                });
+                BenchmarkResult t_halide = timer.last;
+                PerfSample c_halide = timer.last_counters;
+                timer([&]() {
+                    dnnl_sgemm('N', 'N', matrix_size, matrix_size, matrix_size, 1.0f,
+                               mat_A.data(), matrix_size, mat_B.data(), matrix_size, 0.0f,
+                               output_ref.data(), matrix_size);
+                });
+                BenchmarkResult t_onednn = timer.last;
+                PerfSample c_onednn = timer.last_counters;
+
+                double gflops = 2.0 * matrix_size * matrix_size * matrix_size / 1e9;
+                float err = compare_buffers(output_ref, output_halide, Tolerance()).max_abs_error;
+                std::string shape = std::to_string(matrix_size);
+                report({kernel, "halide", "-", shape, 0, 0, threads, t_halide, gflops, err, c_halide});
+                report({kernel, "onednn", "-", shape, 0, 0, threads, t_onednn, gflops, err, c_onednn});
+            }
+            continue;
+        }
+
+        if (kernel != "conv" && kernel != "dilated_conv" && kernel != "op_fuse") {
+            printf("unknown kernel %s\n", kernel.c_str());
+            return 1;
+        }
+        for (const std::string &shape_str : shapes) {
+            ConvConfig c = {};
+            if (!parse_conv_shape(shape_str.c_str(), c)) {
+                printf("--shapes expects N,CI,CO,W,H,KW,KH;...\n");
+                return 1;
+            }
+            // conv has no dilation
+            std::vector<std::string> kernel_dilations = kernel == "conv" ? std::vector<std::string>{"0"} : dilations;
+            for (const std::string &d : kernel_dilations) {
+                c.DW = c.DH = atoi(d.c_str());
+
+                Buffer<float, 4> in(c.CI, c.W + (c.KW - 1) * (c.DW + 1), c.H + (c.KH - 1) * (c.DH + 1), c.N);
+                Buffer<float, 4> fil(c.CO, c.KW, c.KH, c.CI);
+                Buffer<float, 4> output_halide(c.CO, c.W, c.H, c.N);
+                Buffer<float, 4> output_ref(c.CO, c.W, c.H, c.N);
+                random_data<float, 4>(in);
+                random_data<float, 4>(fil);
+                // a new filter, possibly at the address of the last case's
+                dnnl_conv_layer_invalidate(c);
+
+                std::string algo = "direct";
+                std::function<void()> run;
+                if (kernel == "conv") {
+                    run = [&]() { halide_conv(in.raw_buffer(), fil.raw_buffer(), 1, 1, 0, 0, output_halide.raw_buffer()); };
+                } else if (kernel == "dilated_conv") {
+                    // the same choice as dilated_conv --algo auto
+                    bool use_s2b = prefer_space_to_batch(c.CI, c.CO, c.W, c.H, c.KW, c.KH, c.DW, c.DH,
+                                                         get_jit_target_from_environment().natural_vector_size<float>(),
+                                                         cache_sizes().l2);
+                    algo = use_s2b ? "s2b" : "direct";
+                    if (use_s2b) {
+                        run = [&]() { halide_dilated_conv_s2b(in.raw_buffer(), fil.raw_buffer(), c.DW, c.DH, output_halide.raw_buffer()); };
+                    } else {
+                        run = [&]() { halide_dilated_conv(in.raw_buffer(), fil.raw_buffer(), c.DW, c.DH, 1, 1, 0, 0, output_halide.raw_buffer()); };
+                    }
+                } else {
+                    run = [&]() { halide_op_fuse(in.raw_buffer(), fil.raw_buffer(), c.DW, c.DH, output_halide.raw_buffer()); };
+                }
+                for (int threads : thread_counts) {
+                    use_threads(threading, threads);
+                    timer(run);
+                    BenchmarkResult t_halide = timer.last;
+                    PerfSample c_halide = timer.last_counters;
+
+                    dnnl_dilated_conv_wrapper(in.data(), fil.data(), output_ref.data(), c, time_dnnl);
+                    BenchmarkResult t_onednn = timer.last;
+                    PerfSample c_onednn = timer.last_counters;
+                    if (kernel == "op_fuse") {
+                        dnnl_batch_normalization_wrapper(output_ref.data(), epsilon, {c.N, c.CO, c.H, c.W}, time_dnnl);
+                        t_onednn = combine(t_onednn, timer.last);
+                        c_onednn += timer.last_counters;
+                    }
+
+                    double gflops = 2.0 * c.N * c.CO * c.H * c.W * c.CI * c.KH * c.KW / 1e9;
+                    float err = compare_buffers(output_ref, output_halide, Tolerance()).max_abs_error;
+                    report({kernel, "halide", algo, shape_str, c.DW, c.DH, threads, t_halide, gflops, err, c_halide});
+                    report({kernel, "onednn", "-", shape_str, c.DW, c.DH, threads, t_onednn, gflops, err, c_onednn});
+                }
+            }
+        }
+    }
+
+    if (!csv.empty()) {
+        write_csv(csv, records);
+    }
+    if (!json.empty()) {
+        write_json(json, records);
+    }
+
+    return 0;
+}
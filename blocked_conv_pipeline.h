@@ -0,0 +1,105 @@
+#ifndef BLOCKED_CONV_PIPELINE_H
+#define BLOCKED_CONV_PIPELINE_H
+
+#include "Halide.h"
+#include "pipeline_common.h"
+
+#include <algorithm>
+
+using namespace Halide;
+
+// Dilated convolution on the blocked channel layouts oneDNN picks for its own
+// convolutions: nChw8c / nChw16c activations and OIhw8i8o / OIhw16i16o
+// weights. Tensors in these layouts pass between the two engines as they
+// are, where the plain (c, x, y, n) pipelines make oneDNN reorder its input
+// and output on every call. As Halide buffers, with B the channel block:
+//  - activations are (c % B, x, y, c / B, n);
+//  - weights are (co % B, ci % B, kx, ky, ci / B, co / B).
+// An output block is one or two vectors, and the reduction walks the input
+// channels of a block, which are contiguous, before the taps.
+
+// Works for both ImageParam (JIT) and Input<Buffer<>> (generators).
+template <typename InputBuffer>
+inline ConvShape blocked_conv_shape(const InputBuffer &input, const InputBuffer &filter, Expr DW = 0, Expr DH = 0,
+                                    Expr SW = 1, Expr SH = 1, Expr PW = 0, Expr PH = 0) {
+    ConvShape s;
+    s.N = input.dim(4).extent();
+    s.CI = input.dim(0).extent() * input.dim(3).extent();
+    s.CO = filter.dim(0).extent() * filter.dim(5).extent();
+    s.KW = filter.dim(2).extent();
+    s.KH = filter.dim(3).extent();
+    s.IW = input.dim(1).extent();
+    s.IH = input.dim(2).extent();
+    s.SW = SW;
+    s.SH = SH;
+    s.PW = PW;
+    s.PH = PH;
+    s.W = (s.IW + 2 * PW - (s.KW - 1) * (DW + 1) - 1) / SW + 1;
+    s.H = (s.IH + 2 * PH - (s.KH - 1) * (DH + 1) - 1) / SH + 1;
+    return s;
+}
+
+class BlockedConvPipeline {
+ public:
+    Var c{"c"}, x{"x"}, y{"y"}, cb{"cb"}, n{"n"};
+    Var xo{"xo"}, xi{"xi"};
+    Func blocked_conv{"blocked_conv"}, out{"out"};
+    ConvShape shape;
+    RDom r;
+    int block = 8;
+
+    // `block` is the channel block B of every tensor, 8 or 16
+    void define(Func input, Func filter, const ConvShape &shape, int block, Expr DW, Expr DH) {
+        this->shape = shape;
+        this->block = block;
+        r = RDom(0, block, 0, shape.KW, 0, shape.KH, 0, shape.CI / block);
+
+        // zero padding of the blocked input, as zero_pad does for the plain one
+        Func padded("padded");
+        Expr unpadded = shape.PW == 0 && shape.PH == 0;
+        Expr inside = x >= 0 && x < shape.IW && y >= 0 && y < shape.IH;
+        padded(c, x, y, cb, n) = select(likely(unpadded || inside),
+                                        input(c, clamp(x, 0, shape.IW - 1), clamp(y, 0, shape.IH - 1), cb, n), 0.0f);
+
+        blocked_conv(c, x, y, cb, n) = 0.0f;
+        blocked_conv(c, x, y, cb, n) += filter(c, r.x, r.y, r.z, r.w, cb) *
+                                        padded(r.x, x * shape.SW + r.y * (DW + 1) - shape.PW,
+                                               y * shape.SH + r.z * (DH + 1) - shape.PH, r.w, n);
+        out(c, x, y, cb, n) = blocked_conv(c, x, y, cb, n);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = std::min(target.natural_vector_size<float>(), block);
+        // about 8 vector accumulators: an output block by tile_w columns
+        const int tile_w = std::max(1, 8 * vec / block);
+
+        // the channels are whole vectors, only the width can have a tail
+        out.output_buffer().dim(0).set_bounds(0, block);
+        auto schedule_tiles = [&](Stage stage, TailStrategy tail) {
+            stage.split(x, xo, xi, tile_w, tail)
+                .reorder(c, xi, xo, y, cb, n)
+                .vectorize(c, vec)
+                .unroll(c)
+                .unroll(xi)
+                .parallel(y)
+                .parallel(cb)
+                .parallel(n);
+        };
+        Expr W = out.output_buffer().dim(1).extent();
+        schedule_tiles(out.specialize(W >= tile_w), TailStrategy::ShiftInwards);
+        schedule_tiles(out, TailStrategy::GuardWithIf);
+
+        blocked_conv.compute_at(out, xo)
+            .vectorize(c, vec)
+            .unroll(c)
+            .unroll(x);
+        blocked_conv.update()
+            .reorder(c, x, r.x, r.y, r.z, r.w, y, cb, n)
+            .vectorize(c, vec)
+            .unroll(c)
+            .unroll(x);
+        blocked_conv.update().specialize(is_dense(shape));
+    }
+};
+
+#endif
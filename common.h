@@ -5,6 +5,23 @@
 #include "example_utils.hpp"
 #include "halide_benchmark.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
 using namespace dnnl;
 using namespace Halide;
 using namespace Halide::Tools;
@@ -12,172 +29,862 @@ using namespace Halide::Tools;
 using tag = memory::format_tag;
 using dt = memory::data_type;
 
+// W and H are the output extents. Stride and zero padding (on each side)
+// default to the original stride 1, unpadded layers.
 struct ConvConfig {
     int N, CI, CO, W, H, KW, KH, DW, DH;
+    int SW = 1, SH = 1, PW = 0, PH = 0;
+    // CI and CO are split into this many groups, the filter is (CO, KW, KH, CI / groups)
+    int groups = 1;
+    // channel block of the tensors oneDNN is handed: 0 for the plain NHWC
+    // activations and IHWO weights, 8 or 16 for nChw8c / nChw16c and
+    // OIhw8i8o / OIhw16i16o (see to_blocked)
+    int block = 0;
+
+    // input extents that produce a W x H output
+    int input_w() const {
+        return (W - 1) * SW + (KW - 1) * (DW + 1) + 1 - 2 * PW;
+    }
+    int input_h() const {
+        return (H - 1) * SH + (KH - 1) * (DH + 1) + 1 - 2 * PH;
+    }
+
+    bool is_dense() const {
+        return SW == 1 && SH == 1 && PW == 0 && PH == 0;
+    }
+
+    // one group per channel
+    bool is_depthwise() const {
+        return groups > 1 && groups == CI && groups == CO;
+    }
 };
 
 struct BNConfig {
     int N, C, H, W;
 };
 
-template <typename T, int D>
-inline void random_data(Buffer<T, D> &b) {
-    b.for_each_value([](T &value) {
-        value = (T)(rand() % 256) / 256.0f;
+// Returns whether `flag` was passed on the command line, and removes it from
+// argv so the positional arguments keep their indices.
+inline bool take_flag(int &argc, char **argv, const char *flag) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], flag) == 0) {
+            for (int j = i; j < argc - 1; j++) {
+                argv[j] = argv[j + 1];
+            }
+            argc--;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the value following `option` on the command line, or `def` if the
+// option is absent, and removes both from argv.
+inline const char *take_option(int &argc, char **argv, const char *option, const char *def) {
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], option) == 0) {
+            const char *value = argv[i + 1];
+            for (int j = i; j < argc - 2; j++) {
+                argv[j] = argv[j + 2];
+            }
+            argc -= 2;
+            return value;
+        }
+    }
+    return def;
+}
+
+// Parses a layer shape given as "N,CI,CO,W,H,KW,KH" into `c`.
+inline bool parse_conv_shape(const char *s, ConvConfig &c) {
+    return sscanf(s, "%d,%d,%d,%d,%d,%d,%d", &c.N, &c.CI, &c.CO, &c.W, &c.H, &c.KW, &c.KH) == 7;
+}
+
+// Parses a stride "S" or "SW,SH" and a padding "P", "PW,PH" or "same" into
+// `c`, whose kernel and dilation must already be set. "same" pads so that a
+// stride 1 layer keeps its input size.
+inline bool parse_stride_padding(const char *stride, const char *pad, ConvConfig &c) {
+    auto parse_pair = [](const char *s, int &a, int &b) {
+        int n = sscanf(s, "%d,%d", &a, &b);
+        if (n == 1) {
+            b = a;
+        }
+        return n >= 1;
+    };
+    if (!parse_pair(stride, c.SW, c.SH) || c.SW < 1 || c.SH < 1) {
+        printf("--stride expects S or SW,SH\n");
+        return false;
+    }
+    if (strcmp(pad, "same") == 0) {
+        c.PW = (c.KW - 1) * (c.DW + 1) / 2;
+        c.PH = (c.KH - 1) * (c.DH + 1) / 2;
+    } else if (!parse_pair(pad, c.PW, c.PH) || c.PW < 0 || c.PH < 0) {
+        printf("--pad expects P, PW,PH or same\n");
+        return false;
+    }
+    if (c.input_w() < 1 || c.input_h() < 1) {
+        printf("padding larger than the input\n");
+        return false;
+    }
+    return true;
+}
+
+// Reads --stride and --pad (see parse_stride_padding) into `c`.
+inline bool take_stride_padding(int &argc, char **argv, ConvConfig &c) {
+    const char *stride = take_option(argc, argv, "--stride", "1");
+    const char *pad = take_option(argc, argv, "--pad", "0");
+    return parse_stride_padding(stride, pad, c);
+}
+
+// The (c, x, y, n) buffer `b` viewed as (c % group size, group, x, y, n),
+// without a copy: the output layout of the grouped conv pipeline.
+inline Buffer<float, 5> grouped_view(Buffer<float, 4> &b, int groups) {
+    const int group_c = b.dim(0).extent() / groups;
+    halide_dimension_t shape[5] = {
+        {0, group_c, b.dim(0).stride()},
+        {0, groups, b.dim(0).stride() * group_c},
+        {0, b.dim(1).extent(), b.dim(1).stride()},
+        {0, b.dim(2).extent(), b.dim(2).stride()},
+        {0, b.dim(3).extent(), b.dim(3).stride()},
+    };
+    return Buffer<float, 5>(b.data(), 5, shape);
+}
+
+// The (c, x, y, n) buffer `b` copied into the nChw<block>c layout, the
+// (c % block, x, y, c / block, n) buffer of blocked_conv_pipeline.h.
+inline Buffer<float, 5> to_blocked(const Buffer<float, 4> &b, int block) {
+    Buffer<float, 5> out(block, b.dim(1).extent(), b.dim(2).extent(), b.dim(0).extent() / block, b.dim(3).extent());
+    out.for_each_element([&](int c, int x, int y, int cb, int n) { out(c, x, y, cb, n) = b(cb * block + c, x, y, n); });
+    return out;
+}
+
+// The (co, kx, ky, ci) filter copied into the OIhw<block>i<block>o layout,
+// a (co % block, ci % block, kx, ky, ci / block, co / block) buffer.
+inline Buffer<float, 6> to_blocked_filter(const Buffer<float, 4> &f, int block) {
+    Buffer<float, 6> out(block, block, f.dim(1).extent(), f.dim(2).extent(), f.dim(3).extent() / block,
+                         f.dim(0).extent() / block);
+    out.for_each_element([&](int co, int ci, int kx, int ky, int cib, int cob) {
+        out(co, ci, kx, ky, cib, cob) = f(cob * block + co, kx, ky, cib * block + ci);
+    });
+    return out;
+}
+
+// Folds an inference-mode batchnorm, scale * (x - mean) / sqrt(variance + epsilon) + shift,
+// into the (co, kw, kh, ci) filter of the conv before it and a per-channel bias.
+inline void fold_batch_norm(const Buffer<float, 4> &filter, const Buffer<float, 1> &mean,
+                            const Buffer<float, 1> &variance, const Buffer<float, 1> &scale,
+                            const Buffer<float, 1> &shift, float epsilon,
+                            Buffer<float, 4> &folded, Buffer<float, 1> &bias) {
+    Buffer<float, 1> k(filter.dim(0).extent());
+    k.for_each_element([&](int co) {
+        k(co) = scale(co) / std::sqrt(variance(co) + epsilon);
+        bias(co) = shift(co) - mean(co) * k(co);
     });
+    folded.for_each_element([&](int co, int kw, int kh, int ci) {
+        folded(co, kw, kh, ci) = filter(co, kw, kh, ci) * k(co);
+    });
+}
+
+// Philox4x32-10 counter-based generator: four random words per (counter, key)
+// pair, with no state, so any element can be generated independently.
+inline void philox4x32(uint64_t counter, uint64_t key, uint32_t out[4]) {
+    uint32_t c[4] = {(uint32_t)counter, (uint32_t)(counter >> 32), 0, 0};
+    uint32_t k[2] = {(uint32_t)key, (uint32_t)(key >> 32)};
+    for (int round = 0; round < 10; round++) {
+        if (round > 0) {
+            k[0] += 0x9E3779B9;
+            k[1] += 0xBB67AE85;
+        }
+        uint64_t p0 = (uint64_t)0xD2511F53 * c[0];
+        uint64_t p1 = (uint64_t)0xCD9E8D57 * c[2];
+        uint32_t next[4] = {(uint32_t)(p1 >> 32) ^ c[1] ^ k[0], (uint32_t)p1,
+                            (uint32_t)(p0 >> 32) ^ c[3] ^ k[1], (uint32_t)p0};
+        memcpy(c, next, sizeof(c));
+    }
+    memcpy(out, c, sizeof(c));
 }
 
+struct RandomDistribution {
+    enum Kind {
+        Byte,     // multiples of 1/256 in [0, 1), exact in float products
+        Uniform,  // uniform in [a, b)
+        Normal,   // mean a, standard deviation b
+    } kind = Byte;
+    float a = 0, b = 1;
+};
+
+// Every random_data call without an explicit seed draws the next one, so
+// the buffers of a run differ from each other but are the same on every run.
+inline uint64_t next_random_seed() {
+    static std::atomic<uint64_t> seed{0};
+    return seed++;
+}
+
+// Element i of a buffer with storage in [begin, end) is drawn from counter
+// i / 4 of the Philox stream `seed`, so the contents depend only on the seed
+// and the chunks can be filled in parallel.
+inline void random_fill(float *data, int64_t begin, int64_t end, const RandomDistribution &dist, uint64_t seed) {
+    for (int64_t i = begin & ~(int64_t)3; i < end; i += 4) {
+        uint32_t r[4];
+        philox4x32(i / 4, seed, r);
+        float v[4];
+        if (dist.kind == RandomDistribution::Normal) {
+            // Box-Muller, two normals per pair of words
+            for (int j = 0; j < 4; j += 2) {
+                float u1 = ((r[j] >> 8) + 1) * (1.0f / 16777216.0f);
+                float u2 = (r[j + 1] >> 8) * (1.0f / 16777216.0f);
+                float radius = std::sqrt(-2.0f * std::log(u1));
+                v[j] = dist.a + dist.b * radius * std::cos(6.28318531f * u2);
+                v[j + 1] = dist.a + dist.b * radius * std::sin(6.28318531f * u2);
+            }
+        } else {
+            for (int j = 0; j < 4; j++) {
+                v[j] = dist.kind == RandomDistribution::Byte ?
+                           (r[j] & 255) / 256.0f :
+                           dist.a + (dist.b - dist.a) * ((r[j] >> 8) * (1.0f / 16777216.0f));
+            }
+        }
+        for (int j = 0; j < 4; j++) {
+            if (i + j >= begin && i + j < end) {
+                data[i + j] = v[j];
+            }
+        }
+    }
+}
+
+// Fills `b` from `dist`, deterministically for a given seed and in parallel
+// over its storage.
 template <typename T, int D>
-class Checker {
- public:
-    bool equal;
-    const Buffer<T, D> &b1;
-    const Buffer<T, D> &b2;
-    Checker(const Buffer<T, D> &b1, const Buffer<T, D> &b2) : b1(b1), b2(b2) {
-        equal = true;
+inline void random_data(Buffer<T, D> &b, const RandomDistribution &dist = RandomDistribution(),
+                        uint64_t seed = next_random_seed()) {
+    static_assert(std::is_same<T, float>::value, "random_data only supports float");
+    if (b.size_in_bytes() != b.number_of_elements() * sizeof(T)) {
+        // not dense: fill a dense copy and copy it over
+        Buffer<T, D> dense = b.copy();
+        random_data(dense, dist, seed);
+        b.copy_from(dense);
+        return;
+    }
+    const int64_t elements = b.number_of_elements();
+    const int64_t min_chunk = 1 << 16;
+    const int64_t chunks = std::max<int64_t>(1, std::min<int64_t>(std::thread::hardware_concurrency(), elements / min_chunk));
+    const int64_t chunk = (elements + chunks - 1) / chunks;
+    std::vector<std::thread> workers;
+    for (int64_t c = 0; c < chunks; c++) {
+        workers.emplace_back([&, c]() {
+            random_fill(b.data(), c * chunk, std::min(elements, (c + 1) * chunk), dist, seed);
+        });
     }
-    template<typename... Args>
-    void operator() (Args... args) {
-       equal &= (std::abs(b1(args...) - b2(args...)) < 0.001f);
+    for (auto &w : workers) {
+        w.join();
     }
+}
+
+// An element matches when it is within any of the enabled tolerances:
+// absolute, relative to the reference value, or in units in the last place.
+struct Tolerance {
+    float abs = 0.001f;
+    float rel = 0;
+    int ulp = 0;
+};
+
+// Reads --atol, --rtol and --ulp, starting from `def`.
+inline Tolerance take_tolerance(int &argc, char **argv, Tolerance def = Tolerance()) {
+    def.abs = atof(take_option(argc, argv, "--atol", std::to_string(def.abs).c_str()));
+    def.rel = atof(take_option(argc, argv, "--rtol", std::to_string(def.rel).c_str()));
+    def.ulp = atoi(take_option(argc, argv, "--ulp", std::to_string(def.ulp).c_str()));
+    return def;
+}
+
+struct CheckResult {
+    int64_t elements = 0, mismatches = 0;
+    float max_abs_error = 0;
+    int64_t max_error_index = 0;       // linear index into the storage
+    std::vector<int> max_error_pos;    // and its coordinates
+    float expected = 0, actual = 0;    // the values there
 };
 
+// Floats mapped to integers that are ordered like the floats, so the ULP
+// distance is a subtraction.
+inline int64_t ordered_float_bits(float f) {
+    int32_t i;
+    memcpy(&i, &f, sizeof(i));
+    return i < 0 ? (int64_t)INT32_MIN - i : i;
+}
+
+// |ref - out| as reported, and as the worst element is located: a NaN on
+// either side counts as an infinite error, so that it is reported rather
+// than lost in the max.
+inline float element_error(float ref, float out) {
+    float e = ref == out ? 0.0f : std::abs(ref - out);
+    return e != e ? std::numeric_limits<float>::infinity() : e;
+}
+
+// Compares [begin, end) of two dense arrays. The loop runs in fixed-width
+// lane blocks with branch-free per-lane accumulators so it vectorizes.
+inline void compare_range(const float *ref, const float *out, int64_t begin, int64_t end,
+                          const Tolerance &tol, int64_t &mismatches, float &max_error) {
+    constexpr int lanes = 16;
+    int64_t lane_bad[lanes] = {};
+    float lane_max[lanes] = {};
+    auto compare = [&](int64_t i, int l) {
+        float e = std::abs(ref[i] - out[i]);
+        float bound = std::max(tol.abs, tol.rel * std::abs(ref[i]));
+        int64_t ulps = std::abs(ordered_float_bits(ref[i]) - ordered_float_bits(out[i]));
+        // NaNs compare false, so they count as mismatches
+        lane_bad[l] += !(e <= bound) & !(ulps <= tol.ulp);
+        float err = element_error(ref[i], out[i]);
+        lane_max[l] = err > lane_max[l] ? err : lane_max[l];
+    };
+    int64_t i = begin;
+    for (; i + lanes <= end; i += lanes) {
+        for (int l = 0; l < lanes; l++) {
+            compare(i + l, l);
+        }
+    }
+    for (; i < end; i++) {
+        compare(i, 0);
+    }
+    mismatches = 0;
+    max_error = 0;
+    for (int l = 0; l < lanes; l++) {
+        mismatches += lane_bad[l];
+        max_error = std::max(max_error, lane_max[l]);
+    }
+}
+
+// Compares `out` against the reference `ref`, in parallel chunks over the
+// contiguous storage of the two buffers, which must have the same shape and
+// dense strides (as every buffer the drivers allocate does).
+template <typename T, int D>
+inline CheckResult compare_buffers(const Buffer<T, D> &ref, const Buffer<T, D> &out, const Tolerance &tol) {
+    static_assert(std::is_same<T, float>::value, "compare_buffers only supports float");
+    CheckResult r;
+    r.elements = ref.number_of_elements();
+    if (r.elements == 0) {
+        return r;
+    }
+    const float *a = ref.data(), *b = out.data();
+
+    const int64_t min_chunk = 1 << 16;
+    const int64_t chunks = std::max<int64_t>(1, std::min<int64_t>(std::thread::hardware_concurrency(), r.elements / min_chunk));
+    const int64_t chunk = (r.elements + chunks - 1) / chunks;
+    std::vector<int64_t> mismatches(chunks);
+    std::vector<float> max_error(chunks);
+    std::vector<std::thread> workers;
+    for (int64_t c = 0; c < chunks; c++) {
+        workers.emplace_back([&, c]() {
+            compare_range(a, b, c * chunk, std::min(r.elements, (c + 1) * chunk), tol, mismatches[c], max_error[c]);
+        });
+    }
+    int64_t worst = 0;
+    for (int64_t c = 0; c < chunks; c++) {
+        workers[c].join();
+        r.mismatches += mismatches[c];
+        if (max_error[c] > max_error[worst]) {
+            worst = c;
+        }
+    }
+    r.max_abs_error = max_error[worst];
+
+    // locate the max error: rescan only the chunk that holds it
+    for (int64_t i = worst * chunk; i < std::min(r.elements, (worst + 1) * chunk); i++) {
+        if (element_error(a[i], b[i]) == r.max_abs_error) {
+            r.max_error_index = i;
+            break;
+        }
+    }
+    for (int d = 0; d < ref.dimensions(); d++) {
+        r.max_error_pos.push_back(ref.dim(d).min() + (int)(r.max_error_index / ref.dim(d).stride() % ref.dim(d).extent()));
+    }
+    r.expected = a[r.max_error_index];
+    r.actual = b[r.max_error_index];
+    return r;
+}
+
+// Returns whether `out` matches the reference `ref`, printing a mismatch
+// report if it does not.
 template <typename T, int D>
-inline bool check_equal(const Buffer<T, D> &b1, const Buffer<T, D> &b2) {
-    Checker<T, D> checker = Checker<T, D>(b1, b2);
-    b1.for_each_element(checker);
-    return checker.equal;
+inline bool check_equal(const Buffer<T, D> &ref, const Buffer<T, D> &out, const Tolerance &tol = Tolerance()) {
+    bool dense = ref.size_in_bytes() == ref.number_of_elements() * sizeof(T);
+    for (int d = 0; d < ref.dimensions(); d++) {
+        dense &= ref.dim(d).extent() == out.dim(d).extent() && ref.dim(d).stride() == out.dim(d).stride();
+    }
+    if (!dense) {
+        printf("check_equal: buffers must be dense and of the same shape\n");
+        return false;
+    }
+    CheckResult r = compare_buffers(ref, out, tol);
+    if (r.mismatches > 0) {
+        printf("%lld of %lld elements mismatch (atol %g, rtol %g, ulp %d); max abs error %g at (",
+               (long long)r.mismatches, (long long)r.elements, tol.abs, tol.rel, tol.ulp, r.max_abs_error);
+        for (size_t d = 0; d < r.max_error_pos.size(); d++) {
+            printf("%s%d", d ? ", " : "", r.max_error_pos[d]);
+        }
+        printf("): expected %g, got %g\n", r.expected, r.actual);
+    }
+    return r.mismatches == 0;
+}
+
+// Times the primitive execution in the wrappers below. The default is the
+// fixed 10 x 10 sampling; bench_suite passes the adaptive benchmark instead.
+using BenchmarkTimer = std::function<double(const std::function<void()> &)>;
+
+inline double fixed_benchmark(const std::function<void()> &op) {
+    return benchmark(10, 10, op);
+}
+
+// oneDNN objects shared by the wrappers below: one CPU engine per process and
+// a stream per thread, and per layer config the primitive with its memories
+// and reorders, so repeated calls only execute. The conv weights are
+// reordered once per filter: the layer remembers the buffer it reordered, and
+// a caller that writes new values into the same buffer calls
+// dnnl_conv_layer_invalidate(). The batchnorm parameters, a few floats per
+// channel, are copied on every call.
+inline dnnl::engine &dnnl_engine() {
+    static dnnl::engine engine(dnnl::engine::kind::cpu, 0);
+    return engine;
+}
+
+inline dnnl::stream &dnnl_stream() {
+    static thread_local dnnl::stream engine_stream(dnnl_engine());
+    return engine_stream;
+}
+
+using DnnlLayerKey = std::vector<int>;
+
+// A cached layer, locked for the caller. The wrappers bind the caller's
+// buffers to the layer's memories and execute on them, so calls with the same
+// config from several threads take turns.
+template <typename Layer>
+struct DnnlLockedLayer {
+    Layer &layer;
+    std::unique_lock<std::mutex> lock;
+};
+
+template <typename Layer>
+class DnnlLayerCache {
+ public:
+    // Returns the cached layer for `key`, calling `create` to build it on a miss.
+    DnnlLockedLayer<Layer> get(const DnnlLayerKey &key, const std::function<void(Layer &)> &create) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = layers.find(key);
+        if (it == layers.end()) {
+            it = layers.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple()).first;
+            create(it->second.layer);
+        }
+        return {it->second.layer, std::unique_lock<std::mutex>(it->second.mutex)};
+    }
+
+ private:
+    struct Entry {
+        Layer layer;
+        std::mutex mutex;
+    };
+    std::mutex mutex;
+    std::map<DnnlLayerKey, Entry> layers;
+};
+
+inline int float_bits(float f) {
+    int i;
+    memcpy(&i, &f, sizeof(i));
+    return i;
+}
+
+struct DnnlConvLayer {
+    // user_src, user_weights and user_dst wrap the caller's buffers, src,
+    // weights and dst are in the primitive's layouts (the same memories when
+    // no reorder is needed)
+    memory user_src, user_weights, user_dst, src, weights, dst;
+    reorder src_reorder, weights_reorder, dst_reorder;
+    convolution_forward prim;
+    std::unordered_map<int, memory> args;
+    // the caller's buffer `weights` was reordered from, if any
+    const float *weights_source = nullptr;
+    // bytes read and written by the reorders of every call, of src and dst,
+    // and by the reorder of a new filter, which is not timed
+    double call_reorder_bytes = 0, weights_reorder_bytes = 0;
+};
+
+inline DnnlLockedLayer<DnnlConvLayer> dnnl_conv_layer(ConvConfig c) {
+    static DnnlLayerCache<DnnlConvLayer> cache;
+    DnnlLayerKey key = {c.N, c.CI, c.CO, c.W, c.H, c.KW, c.KH, c.DW, c.DH, c.SW, c.SH, c.PW, c.PH, c.groups, c.block};
+    return cache.get(key, [&](DnnlConvLayer &l) {
+        dnnl::engine &engine = dnnl_engine();
+
+        memory::dims src_dims = {c.N, c.CI, c.input_h(), c.input_w()};
+        // grouped weights are (G, CO / G, CI / G, KH, KW)
+        const int G = c.groups;
+        memory::dims weights_dims = {c.CO, c.CI, c.KH, c.KW};
+        if (G > 1) {
+            weights_dims = {G, c.CO / G, c.CI / G, c.KH, c.KW};
+        }
+        memory::dims dst_dims = {c.N, c.CO, c.H, c.W};
+        memory::dims strides_dims = {c.SH, c.SW};
+        memory::dims dilates_dims = {c.DH, c.DW};
+        memory::dims padding_dims_l = {c.PH, c.PW};
+        memory::dims padding_dims_r = {c.PH, c.PW};
+
+        // Create memory objects for tensor data (src, weights, dst).
+        // NHWC layout is assumed for src and dst, and IHWO for weights, or
+        // the blocked layouts of c.block; the grouped weights keep the same
+        // (co, kw, kh, ci) order, which no format tag describes, so they get
+        // explicit strides.
+        // src and dst get the caller's buffers on every call, the weights
+        // when they are new.
+        tag act_tag = c.block == 16 ? tag::nChw16c : c.block == 8 ? tag::nChw8c : tag::nhwc;
+        tag weights_tag = c.block == 16 ? tag::OIhw16i16o : c.block == 8 ? tag::OIhw8i8o : tag::ihwo;
+        l.user_src = memory({src_dims, dt::f32, act_tag}, engine, DNNL_MEMORY_NONE);
+        l.user_dst = memory({dst_dims, dt::f32, act_tag}, engine, DNNL_MEMORY_NONE);
+        memory::desc user_weights_md(weights_dims, dt::f32, weights_tag);
+        if (G > 1) {
+            memory::dims weights_strides = {c.CO / G, 1, c.CO * c.KW * c.KH, c.CO * c.KW, c.CO};
+            user_weights_md = memory::desc(weights_dims, dt::f32, weights_strides);
+        }
+        l.user_weights = memory(user_weights_md, engine, DNNL_MEMORY_NONE);
+
+        // Create memory descriptors with format_tag::any for the primitive. This
+        // enables the convolution primitive to choose memory layouts for an
+        // optimized primitive implementation, and these layouts may differ from the
+        // ones provided by the user. The blocked layouts are imposed instead,
+        // since they exist to be exchanged without reorders.
+        auto conv_src_md = memory::desc(src_dims, dt::f32, c.block ? act_tag : tag::any);
+        auto conv_weights_md = memory::desc(weights_dims, dt::f32, c.block ? weights_tag : tag::any);
+        auto conv_dst_md = memory::desc(dst_dims, dt::f32, c.block ? act_tag : tag::any);
+
+        // Create operation descriptor.
+        auto conv_desc = convolution_forward::desc(
+            prop_kind::forward_training, algorithm::convolution_direct,
+            conv_src_md, conv_weights_md, conv_dst_md, strides_dims,
+            dilates_dims, padding_dims_l, padding_dims_r);
+
+        // Create primitive descriptor.
+        convolution_forward::primitive_desc conv_pd;
+        try {
+            conv_pd = convolution_forward::primitive_desc(conv_desc, engine);
+        } catch (const dnnl::error &e) {
+            if (c.block) {
+                printf("oneDNN has no convolution on nChw%dc activations and OIhw%di%do weights on this machine\n",
+                       c.block, c.block, c.block);
+            }
+            throw;
+        }
+
+        l.src = l.user_src;
+        l.weights = l.user_weights;
+        l.dst = l.user_dst;
+
+        // Where the layouts chosen by the primitive differ from the user's,
+        // src, weights and dst get buffers and reorder primitives of their
+        // own, run on every call.
+        if (conv_pd.src_desc() != l.user_src.get_desc()) {
+            l.src = memory(conv_pd.src_desc(), engine);
+            l.src_reorder = reorder(l.user_src, l.src);
+            l.call_reorder_bytes += l.user_src.get_desc().get_size() + conv_pd.src_desc().get_size();
+        }
+        if (conv_pd.weights_desc() != l.user_weights.get_desc()) {
+            l.weights = memory(conv_pd.weights_desc(), engine);
+            l.weights_reorder = reorder(l.user_weights, l.weights);
+            l.weights_reorder_bytes += user_weights_md.get_size() + conv_pd.weights_desc().get_size();
+        }
+        if (conv_pd.dst_desc() != l.user_dst.get_desc()) {
+            l.dst = memory(conv_pd.dst_desc(), engine);
+            l.dst_reorder = reorder(l.dst, l.user_dst);
+            l.call_reorder_bytes += l.user_dst.get_desc().get_size() + conv_pd.dst_desc().get_size();
+        }
+
+        // Create the primitive.
+        l.prim = convolution_forward(conv_pd);
+        // Primitive arguments.
+        l.args.insert({DNNL_ARG_SRC, l.src});
+        l.args.insert({DNNL_ARG_WEIGHTS, l.weights});
+        l.args.insert({DNNL_ARG_DST, l.dst});
+    });
+}
+
+// Drops the reordered weights of the conv layer `c`, for a caller that is
+// about to pass a filter buffer it has already passed, with new values.
+inline void dnnl_conv_layer_invalidate(ConvConfig c) {
+    dnnl_conv_layer(c).layer.weights_source = nullptr;
 }
 
 // dnnl wrapper
-inline double dnnl_dilated_conv_wrapper(float *src, float *weight, float *dst, ConvConfig c) {
-    dnnl::engine engine(dnnl::engine::kind::cpu, 0);
-    dnnl::stream engine_stream(engine);
-
-    memory::dims src_dims = {c.N, c.CI, c.H + (c.KH - 1) * (c.DH + 1), c.W + (c.KW - 1) * (c.DW + 1)};
-    memory::dims weights_dims = {c.CO, c.CI, c.KH, c.KW};
-    memory::dims dst_dims = {c.N, c.CO, c.H, c.W};
-    memory::dims strides_dims = {1, 1};
-    memory::dims dilates_dims = {c.DH, c.DW};
-    memory::dims padding_dims_l = {0, 0};
-    memory::dims padding_dims_r = {0, 0};
-
-    // Create memory objects for tensor data (src, weights, dst).
-    // NHWC layout is assumed for src and dst, and IHWO for weights.
-    auto user_src_mem = memory({src_dims, dt::f32, tag::nhwc}, engine);
-    auto user_weights_mem = memory({weights_dims, dt::f32, tag::ihwo}, engine);
-    auto user_dst_mem = memory({dst_dims, dt::f32, tag::nhwc}, engine);
-
-    // Create memory descriptors with format_tag::any for the primitive. This
-    // enables the convolution primitive to choose memory layouts for an
-    // optimized primitive implementation, and these layouts may differ from the
-    // ones provided by the user.
-    auto conv_src_md = memory::desc(src_dims, dt::f32, tag::any);
-    auto conv_weights_md = memory::desc(weights_dims, dt::f32, tag::any);
-    auto conv_dst_md = memory::desc(dst_dims, dt::f32, tag::any);
-
-    // Write data to memory object's handle.
-    write_to_dnnl_memory(src, user_src_mem);
-    write_to_dnnl_memory(weight, user_weights_mem);
-
-    // Create operation descriptor.
-    auto conv_desc = convolution_forward::desc(
-        prop_kind::forward_training, algorithm::convolution_direct, 
-        conv_src_md, conv_weights_md, conv_dst_md, strides_dims,
-        dilates_dims, padding_dims_l, padding_dims_r);
-
-    // Create primitive descriptor.
-    auto conv_pd = convolution_forward::primitive_desc(conv_desc, engine);
-
-    auto conv_src_mem = user_src_mem;
-    auto conv_weights_mem = user_weights_mem;
-    auto conv_dst_mem = user_dst_mem;
-
-    // Reorder the data in case the src and weights memory layouts generated by
-    // the primitive and the ones provided by the user are different. In this
-    // case, we create additional memory objects with internal buffers that will
-    // contain the reordered data. The data in dst will be reordered after the
-    // convolution computation has finalized.
-    if (conv_pd.src_desc() != user_src_mem.get_desc()) {
-        conv_src_mem = memory(conv_pd.src_desc(), engine);
-        reorder(user_src_mem, conv_src_mem)
-            .execute(engine_stream, user_src_mem, conv_src_mem);
-    }
-    if (conv_pd.weights_desc() != user_weights_mem.get_desc()) {
-        conv_weights_mem = memory(conv_pd.weights_desc(), engine);
-        reorder(user_weights_mem, conv_weights_mem)
-            .execute(engine_stream, user_weights_mem, conv_weights_mem);
-    }
-    if (conv_pd.dst_desc() != user_dst_mem.get_desc()) {
-        conv_dst_mem = memory(conv_pd.dst_desc(), engine);
-    }
-
-    // Create the primitive.
-    auto conv_prim = convolution_forward(conv_pd);
-    // Primitive arguments.
-    std::unordered_map<int, memory> conv_args;
-    conv_args.insert({DNNL_ARG_SRC, conv_src_mem});
-    conv_args.insert({DNNL_ARG_WEIGHTS, conv_weights_mem});
-    conv_args.insert({DNNL_ARG_DST, conv_dst_mem});
+inline double dnnl_dilated_conv_wrapper(float *src, float *weight, float *dst, ConvConfig c,
+                                        const BenchmarkTimer &timer = fixed_benchmark) {
+    auto locked = dnnl_conv_layer(c);
+    DnnlConvLayer &l = locked.layer;
+    dnnl::stream &engine_stream = dnnl_stream();
+
+    l.user_src.set_data_handle(src);
+    l.user_dst.set_data_handle(dst);
+    if (l.src_reorder) {
+        l.src_reorder.execute(engine_stream, l.user_src, l.src);
+    }
+    // the primitive reads the caller's weights directly, or the ones
+    // reordered from them by an earlier call
+    if (!l.weights_reorder) {
+        l.user_weights.set_data_handle(weight);
+    } else if (l.weights_source != weight) {
+        l.user_weights.set_data_handle(weight);
+        l.weights_reorder.execute(engine_stream, l.user_weights, l.weights);
+        l.weights_source = weight;
+    }
+    engine_stream.wait();
 
     // Primitive execution
-    double t = benchmark(10, 10, [&]() {
-        conv_prim.execute(engine_stream, conv_args);
+    double t = timer([&]() {
+        l.prim.execute(engine_stream, l.args);
         engine_stream.wait();
     });
 
     // Reorder the data in case the dst memory descriptor generated by the
     // primitive and the one provided by the user are different.
-    if (conv_pd.dst_desc() != user_dst_mem.get_desc()) {
-        reorder(conv_dst_mem, user_dst_mem)
-            .execute(engine_stream, conv_dst_mem, user_dst_mem);
-    } else
-        user_dst_mem = conv_dst_mem;
-    read_from_dnnl_memory(dst, user_dst_mem);
+    if (l.dst_reorder) {
+        l.dst_reorder.execute(engine_stream, l.dst, l.user_dst);
+        engine_stream.wait();
+    }
 
     return t;
 }
 
-inline double dnnl_batch_normalization_wrapper(float *src, const float epsilon, BNConfig c) {
-    dnnl::engine engine(dnnl::engine::kind::cpu, 0);
-    dnnl::stream engine_stream(engine);
+// Backward convolution primitives. Both have two inputs and one output; the
+// user_ memories wrap the caller's buffers (NHWC data, IHWO weights) and get
+// them on every call, the others are in the primitive's layouts (the same
+// memories when no reorder is needed).
+struct DnnlConvBackwardLayer {
+    memory user_in[2], user_out, in[2], out;
+    reorder in_reorder[2], out_reorder;
+    primitive prim;
+    std::unordered_map<int, memory> args;
+};
 
-    memory::dims src_dims = {c.N, c.C, c.H, c.W};
+// Gives `user` a counterpart in the layout `md` chosen by a primitive, with
+// the reorder between them, when the two differ.
+inline void dnnl_bind_layout(const memory &user, const memory::desc &md, memory &mem, reorder &r, bool to_user) {
+    mem = user;
+    if (md != user.get_desc()) {
+        mem = memory(md, dnnl_engine());
+        r = to_user ? reorder(mem, user) : reorder(user, mem);
+    }
+}
 
-    auto src_md = memory::desc(src_dims, dt::f32, tag::nhwc);
-    auto src_mem = memory(src_md, engine);
+// Memory descriptors of the dense conv `c`: src, weights and dst, in the
+// user layouts or, with tag::any, left to the primitive.
+inline std::vector<memory::desc> dnnl_conv_descs(ConvConfig c, bool any) {
+    return {memory::desc({c.N, c.CI, c.input_h(), c.input_w()}, dt::f32, any ? tag::any : tag::nhwc),
+            memory::desc({c.CO, c.CI, c.KH, c.KW}, dt::f32, any ? tag::any : tag::ihwo),
+            memory::desc({c.N, c.CO, c.H, c.W}, dt::f32, any ? tag::any : tag::nhwc)};
+}
 
-    // Write data to memory object's handle.
-    write_to_dnnl_memory(src, src_mem);
+// Builds the backward data (`weights` false) or backward weights primitive of
+// the dense conv `c`; oneDNN needs the forward primitive descriptor as a hint.
+inline DnnlLockedLayer<DnnlConvBackwardLayer> dnnl_conv_backward_layer(ConvConfig c, bool weights) {
+    static DnnlLayerCache<DnnlConvBackwardLayer> cache;
+    DnnlLayerKey key = {c.N, c.CI, c.CO, c.W, c.H, c.KW, c.KH, c.DW, c.DH, c.SW, c.SH, c.PW, c.PH, weights};
+    return cache.get(key, [&](DnnlConvBackwardLayer &l) {
+        dnnl::engine &engine = dnnl_engine();
+
+        std::vector<memory::desc> user = dnnl_conv_descs(c, false);
+        std::vector<memory::desc> any = dnnl_conv_descs(c, true);
+        memory::dims strides_dims = {c.SH, c.SW};
+        memory::dims dilates_dims = {c.DH, c.DW};
+        memory::dims padding_dims = {c.PH, c.PW};
+
+        auto fwd_desc = convolution_forward::desc(
+            prop_kind::forward_training, algorithm::convolution_direct, any[0], any[1], any[2],
+            strides_dims, dilates_dims, padding_dims, padding_dims);
+        auto fwd_pd = convolution_forward::primitive_desc(fwd_desc, engine);
+
+        if (weights) {
+            // src, diff_dst -> diff_weights
+            auto bwd_desc = convolution_backward_weights::desc(
+                algorithm::convolution_direct, any[0], any[1], any[2],
+                strides_dims, dilates_dims, padding_dims, padding_dims);
+            auto bwd_pd = convolution_backward_weights::primitive_desc(bwd_desc, engine, fwd_pd);
+            l.user_in[0] = memory(user[0], engine, DNNL_MEMORY_NONE);
+            l.user_in[1] = memory(user[2], engine, DNNL_MEMORY_NONE);
+            l.user_out = memory(user[1], engine, DNNL_MEMORY_NONE);
+            dnnl_bind_layout(l.user_in[0], bwd_pd.src_desc(), l.in[0], l.in_reorder[0], false);
+            dnnl_bind_layout(l.user_in[1], bwd_pd.diff_dst_desc(), l.in[1], l.in_reorder[1], false);
+            dnnl_bind_layout(l.user_out, bwd_pd.diff_weights_desc(), l.out, l.out_reorder, true);
+            l.prim = convolution_backward_weights(bwd_pd);
+            l.args.insert({DNNL_ARG_SRC, l.in[0]});
+            l.args.insert({DNNL_ARG_DIFF_DST, l.in[1]});
+            l.args.insert({DNNL_ARG_DIFF_WEIGHTS, l.out});
+        } else {
+            // diff_dst, weights -> diff_src
+            auto bwd_desc = convolution_backward_data::desc(
+                algorithm::convolution_direct, any[0], any[1], any[2],
+                strides_dims, dilates_dims, padding_dims, padding_dims);
+            auto bwd_pd = convolution_backward_data::primitive_desc(bwd_desc, engine, fwd_pd);
+            l.user_in[0] = memory(user[2], engine, DNNL_MEMORY_NONE);
+            l.user_in[1] = memory(user[1], engine, DNNL_MEMORY_NONE);
+            l.user_out = memory(user[0], engine, DNNL_MEMORY_NONE);
+            dnnl_bind_layout(l.user_in[0], bwd_pd.diff_dst_desc(), l.in[0], l.in_reorder[0], false);
+            dnnl_bind_layout(l.user_in[1], bwd_pd.weights_desc(), l.in[1], l.in_reorder[1], false);
+            dnnl_bind_layout(l.user_out, bwd_pd.diff_src_desc(), l.out, l.out_reorder, true);
+            l.prim = convolution_backward_data(bwd_pd);
+            l.args.insert({DNNL_ARG_DIFF_DST, l.in[0]});
+            l.args.insert({DNNL_ARG_WEIGHTS, l.in[1]});
+            l.args.insert({DNNL_ARG_DIFF_SRC, l.out});
+        }
+    });
+}
 
-    // Create operation descriptor.
-    auto bnorm_d = batch_normalization_forward::desc(
-        prop_kind::forward_training, src_md, epsilon,
-        normalization_flags::none);
+// Runs a backward layer on the caller's buffers; the reorders are not timed.
+inline double dnnl_conv_backward_execute(DnnlLockedLayer<DnnlConvBackwardLayer> locked, float *in0, float *in1,
+                                         float *out, const BenchmarkTimer &timer) {
+    DnnlConvBackwardLayer &l = locked.layer;
+    dnnl::stream &engine_stream = dnnl_stream();
+
+    l.user_in[0].set_data_handle(in0);
+    l.user_in[1].set_data_handle(in1);
+    l.user_out.set_data_handle(out);
+    for (int i = 0; i < 2; i++) {
+        if (l.in_reorder[i]) {
+            l.in_reorder[i].execute(engine_stream, l.user_in[i], l.in[i]);
+        }
+    }
+
+    double t = timer([&]() {
+        l.prim.execute(engine_stream, l.args);
+        engine_stream.wait();
+    });
+
+    if (l.out_reorder) {
+        l.out_reorder.execute(engine_stream, l.out, l.user_out);
+        engine_stream.wait();
+    }
+    return t;
+}
+
+// Input gradient of the (ungrouped) dilated conv `c`: diff_src from diff_dst and the weights.
+inline double dnnl_dilated_conv_backward_data_wrapper(float *diff_dst, float *weight, float *diff_src, ConvConfig c,
+                                                      const BenchmarkTimer &timer = fixed_benchmark) {
+    return dnnl_conv_backward_execute(dnnl_conv_backward_layer(c, false), diff_dst, weight, diff_src, timer);
+}
+
+// Weight gradient of the (ungrouped) dilated conv `c`: diff_weights from src and diff_dst.
+inline double dnnl_dilated_conv_backward_weights_wrapper(float *src, float *diff_dst, float *diff_weights, ConvConfig c,
+                                                         const BenchmarkTimer &timer = fixed_benchmark) {
+    return dnnl_conv_backward_execute(dnnl_conv_backward_layer(c, true), src, diff_dst, diff_weights, timer);
+}
+
+struct DnnlBatchNormLayer {
+    memory src, dst, mean, variance, scale, shift;
+    batch_normalization_forward prim;
+    std::unordered_map<int, memory> args;
+};
 
-    // Create primitive descriptor.
-    auto bnorm_pd = batch_normalization_forward::primitive_desc(bnorm_d, engine);
+inline double dnnl_batch_normalization_wrapper(float *src, const float epsilon, BNConfig c,
+                                               const BenchmarkTimer &timer = fixed_benchmark) {
+    static DnnlLayerCache<DnnlBatchNormLayer> cache;
+    DnnlLayerKey key = {c.N, c.C, c.H, c.W, float_bits(epsilon)};
+    auto locked = cache.get(key, [&](DnnlBatchNormLayer &l) {
+        dnnl::engine &engine = dnnl_engine();
 
-    auto mean_mem = memory(bnorm_pd.mean_desc(), engine);
-    auto variance_mem = memory(bnorm_pd.variance_desc(), engine);
+        memory::dims src_dims = {c.N, c.C, c.H, c.W};
+
+        auto src_md = memory::desc(src_dims, dt::f32, tag::nhwc);
+        l.src = memory(src_md, engine, DNNL_MEMORY_NONE);
+
+        // Create operation descriptor.
+        auto bnorm_d = batch_normalization_forward::desc(
+            prop_kind::forward_training, src_md, epsilon,
+            normalization_flags::none);
+
+        // Create primitive descriptor.
+        auto bnorm_pd = batch_normalization_forward::primitive_desc(bnorm_d, engine);
+
+        l.mean = memory(bnorm_pd.mean_desc(), engine);
+        l.variance = memory(bnorm_pd.variance_desc(), engine);
+
+        // Create the primitive.
+        l.prim = batch_normalization_forward(bnorm_pd);
+        // Primitive arguments. Set up in-place execution by assigning src as DST.
+        l.args.insert({DNNL_ARG_SRC, l.src});
+        l.args.insert({DNNL_ARG_MEAN, l.mean});
+        l.args.insert({DNNL_ARG_VARIANCE, l.variance});
+        l.args.insert({DNNL_ARG_DST, l.src});
+    });
+    DnnlBatchNormLayer &l = locked.layer;
+    dnnl::stream &engine_stream = dnnl_stream();
+
+    l.src.set_data_handle(src);
+
+    // Primitive execution
+    double t = timer([&]() {
+        l.prim.execute(engine_stream, l.args);
+        engine_stream.wait();
+    });
+
+    return t;
+}
+
+// Inference-mode batchnorm with fixed running statistics, scale and shift,
+// which are copied into the cached layer on every call.
+inline double dnnl_batch_normalization_inference_wrapper(float *src, float *mean, float *variance,
+                                                         float *scale, float *shift,
+                                                         const float epsilon, BNConfig c,
+                                                         const BenchmarkTimer &timer = fixed_benchmark,
+                                                         bool relu = false) {
+    static DnnlLayerCache<DnnlBatchNormLayer> cache;
+    DnnlLayerKey key = {c.N, c.C, c.H, c.W, float_bits(epsilon), relu};
+    auto locked = cache.get(key, [&](DnnlBatchNormLayer &l) {
+        dnnl::engine &engine = dnnl_engine();
+
+        memory::dims src_dims = {c.N, c.C, c.H, c.W};
+        memory::dims channel_dims = {c.C};
+
+        auto src_md = memory::desc(src_dims, dt::f32, tag::nhwc);
+        l.src = memory(src_md, engine, DNNL_MEMORY_NONE);
+        l.dst = memory(src_md, engine);
+        l.scale = memory({channel_dims, dt::f32, tag::x}, engine);
+        l.shift = memory({channel_dims, dt::f32, tag::x}, engine);
+
+        // Create operation descriptor. use_global_stats reads mean and variance
+        // instead of computing them from the batch; fuse_norm_relu applies a
+        // ReLU to the result.
+        auto flags = normalization_flags::use_global_stats | normalization_flags::use_scale | normalization_flags::use_shift;
+        if (relu) {
+            flags |= normalization_flags::fuse_norm_relu;
+        }
+        auto bnorm_d = batch_normalization_forward::desc(prop_kind::forward_inference, src_md, epsilon, flags);
+
+        // Create primitive descriptor.
+        auto bnorm_pd = batch_normalization_forward::primitive_desc(bnorm_d, engine);
+
+        l.mean = memory(bnorm_pd.mean_desc(), engine);
+        l.variance = memory(bnorm_pd.variance_desc(), engine);
+
+        // Create the primitive.
+        l.prim = batch_normalization_forward(bnorm_pd);
+        // Primitive arguments. Unlike the training-mode wrapper this is not run
+        // in place: with fixed statistics, repeated calls would normalize again.
+        l.args.insert({DNNL_ARG_SRC, l.src});
+        l.args.insert({DNNL_ARG_MEAN, l.mean});
+        l.args.insert({DNNL_ARG_VARIANCE, l.variance});
+        l.args.insert({DNNL_ARG_SCALE, l.scale});
+        l.args.insert({DNNL_ARG_SHIFT, l.shift});
+        l.args.insert({DNNL_ARG_DST, l.dst});
+    });
+    DnnlBatchNormLayer &l = locked.layer;
+    dnnl::stream &engine_stream = dnnl_stream();
 
-    // Create the primitive.
-    auto bnorm_prim = batch_normalization_forward(bnorm_pd);
-    // Primitive arguments. Set up in-place execution by assigning src as DST.
-    std::unordered_map<int, memory> bnorm_args;
-    bnorm_args.insert({DNNL_ARG_SRC, src_mem});
-    bnorm_args.insert({DNNL_ARG_MEAN, mean_mem});
-    bnorm_args.insert({DNNL_ARG_VARIANCE, variance_mem});
-    bnorm_args.insert({DNNL_ARG_DST, src_mem});
+    l.src.set_data_handle(src);
+    // the parameters are a few floats per channel
+    write_to_dnnl_memory(mean, l.mean);
+    write_to_dnnl_memory(variance, l.variance);
+    write_to_dnnl_memory(scale, l.scale);
+    write_to_dnnl_memory(shift, l.shift);
 
     // Primitive execution
-    double t = benchmark(10, 10, [&]() {
-        bnorm_prim.execute(engine_stream, bnorm_args);
+    double t = timer([&]() {
+        l.prim.execute(engine_stream, l.args);
         engine_stream.wait();
     });
 
     // Read data from memory object's handle.
-    read_from_dnnl_memory(src, src_mem);
+    read_from_dnnl_memory(src, l.dst);
 
     return t;
 }
@@ -1,5 +1,17 @@
 #include "Halide.h"
 #include "common.h"
+#include "perf_counters.h"
+#include "pool_allocator.h"
+#include "threading.h"
+#include "conv_pipeline.h"
+#include "im2col_conv_pipeline.h"
+#include "winograd_pipeline.h"
+#include "halide_conv.h"
+#include "halide_im2col_conv.h"
+#include "halide_winograd_conv_f2.h"
+#include "halide_winograd_conv_f4.h"
+#include "halide_winograd_filter_f2.h"
+#include "halide_winograd_filter_f4.h"
 
 #include <stdio.h>
 
@@ -7,73 +19,164 @@ using namespace Halide;
 using namespace Halide::Tools;
 
 int main(int argc, char **argv) {
-    const int N = 5, CI = 128, CO = 128, W = 100, H = 80, KW = 3, KH = 3;
+    // --threads, --pin and --numa size and place the Halide and oneDNN thread
+    // pools; this runs before any buffer is allocated (see threading.h)
+    ThreadConfig threading;
+    if (!take_threading(argc, argv, threading)) {
+        return 1;
+    }
+    print_threading(threading);
+    // --alloc system|pool|huge picks the allocator of the Halide intermediates (see pool_allocator.h)
+    if (!take_allocator(argc, argv)) {
+        return 1;
+    }
+    // the pipelines read the layer shape from their buffers, --shape N,CI,CO,W,H,KW,KH overrides the default
+    ConvConfig shape = {};
+    if (!parse_conv_shape(take_option(argc, argv, "--shape", "5,128,128,100,80,3,3"), shape)) {
+        printf("--shape expects N,CI,CO,W,H,KW,KH\n");
+        return 1;
+    }
+    const int N = shape.N, CI = shape.CI, CO = shape.CO, W = shape.W, H = shape.H, KW = shape.KW, KH = shape.KH;
+    // --stride and --pad (see take_stride_padding); zero padding is applied
+    // by the pipeline, so the input buffer is not pre-padded
+    shape.DW = shape.DH = 0;
+    if (!take_stride_padding(argc, argv, shape)) {
+        return 1;
+    }
+    // --counters also reports hardware counters (perf_event_open) of both runs
+    const bool counters = take_flag(argc, argv, "--counters");
+    // the AOT kernel from generators.cpp is the default, --jit builds the pipeline at runtime
+    const bool use_jit = take_flag(argc, argv, "--jit");
+    // --algo picks the direct schedule, im2col + the matmul.cpp GEMM schedule,
+    // or Winograd F(2x2, 3x3) (winograd) / F(4x4, 3x3) (winograd4)
+    const std::string algo = take_option(argc, argv, "--algo", "direct");
+    const bool use_gemm = algo == "gemm";
+    const int winograd_m = algo == "winograd" ? 2 : algo == "winograd4" ? 4 : 0;
+    if (winograd_m && (KW != 3 || KH != 3)) {
+        printf("--algo %s needs a 3x3 kernel\n", algo.c_str());
+        return 1;
+    }
+    // --atol, --rtol and --ulp set the tolerances of the result check. The
+    // Winograd transforms amplify the rounding error of the output, more so
+    // for the larger tile, so by default they get a relative bound too.
+    Tolerance tol_default;
+    tol_default.rel = 4e-5f * winograd_m;
+    const Tolerance tol = take_tolerance(argc, argv, tol_default);
+    if ((winograd_m || use_gemm) && !shape.is_dense()) {
+        printf("--algo %s needs stride 1 and no padding\n", algo.c_str());
+        return 1;
+    }
 
     ImageParam input(type_of<float>(), 4);
     ImageParam filter(type_of<float>(), 4);
+    ImageParam transformed_filter(type_of<float>(), 4);
+    Param<int> sw("SW"), sh("SH"), pw("PW"), ph("PH");
+    ConvPipeline p;
+    Im2colConvPipeline p_gemm;
+    WinogradFilterPipeline p_filter;
+    WinogradConvPipeline p_winograd;
+    Func out;
+
+    if (winograd_m) {
+        printf("algorithm: Winograd F(%dx%d, 3x3)\n", winograd_m, winograd_m);
+    } else {
+        printf("algorithm: %s\n", use_gemm ? "im2col + GEMM" : "direct");
+    }
+    printf("stride: %d x %d, padding: %d x %d\n", shape.SW, shape.SH, shape.PW, shape.PH);
 
-    // define convolution algorithm
-    Var x("x"), y("y"), c("c"), n("n");
-
-    Func conv("conv"), out("out");
-    RDom r(0, CI, 0, KW, 0, KH);
-
-    conv(c, x, y, n) = 0.0f;
-    conv(c, x, y, n) += filter(c, r.y, r.z, r.x) * input(r.x, x + r.y, y + r.z, n);
-
-    out(c, x, y, n) = conv(c, x, y, n);
-
-    // schedules
-    Target target = get_jit_target_from_environment();
-    const int vec = target.natural_vector_size<float>();
-    int tile_w = 3;
-    int tile_h = 4;
-    Var co("co"), ci("ci"), xo("xo"), xi("xi"), yo("yo"), yi("yi"), t("t");
-    out.split(c, co, ci, vec * tile_w)
-        .split(x, xo, xi, tile_h)
-        .reorder(ci, xi, xo, y, n, co)
-        .vectorize(ci, vec)
-        .unroll(ci)
-        .unroll(xi)
-        .parallel(y)
-        .parallel(n)
-        .parallel(co);
-    conv.compute_at(out, xo)
-        .vectorize(c, vec)
-        .unroll(c)
-        .unroll(x)
-        .unroll(y)
-        .update()
-        .reorder(c, x, y, r.x, r.y, r.z, n)
-        .vectorize(c, vec)
-        .unroll(c)
-        .unroll(x)
-        .unroll(y)
-	.unroll(r.x, 2);
-    filter.in().compute_at(conv, r.x).vectorize(_0, vec).unroll(_0).unroll(_3);
-    input.in().compute_at(conv, x).unroll(_0);
-
-    Buffer<float, 4> in(CI, W + KW - 1, H + KH - 1, N);
+    Buffer<float, 4> in(CI, shape.input_w(), shape.input_h(), N);
     Buffer<float, 4> fil(CO, KW, KH, CI);
     Buffer<float, 4> output_halide(CO, W, H, N);
 
     // init randomly
     random_data<float, 4>(in);
     random_data<float, 4>(fil);
-    input.set(in);
-    filter.set(fil);
 
-    // jit compile and warm-up
-    out.realize(output_halide);
+    // the Winograd filter transform only depends on the weights: it runs once
+    // here and every conv call below reuses its output
+    const int t = winograd_m + 2;
+    Buffer<float, 4> U(CO, t, t, CI);
+    double t_filter = 0;
+    if (winograd_m) {
+        auto filter_start = benchmark_now();
+        if (use_jit) {
+            Target target = get_jit_target_from_environment();
+            p_filter.define(filter, winograd_m);
+            p_filter.schedule(target);
+            filter.set(fil);
+            p_filter.out.realize(U, target);
+        } else if (winograd_m == 2) {
+            halide_winograd_filter_f2(fil.raw_buffer(), U.raw_buffer());
+        } else {
+            halide_winograd_filter_f4(fil.raw_buffer(), U.raw_buffer());
+        }
+        t_filter = benchmark_duration_seconds(filter_start, benchmark_now());
+    }
 
-    double t_halide = benchmark(10, 10, [&]() { out.realize(output_halide); });
+    // cold start: pipeline construction, compilation (JIT only) and the first call
+    auto cold_start = benchmark_now();
+    std::function<void()> run;
+    if (use_jit) {
+        Target target = get_jit_target_from_environment();
+        if (winograd_m) {
+            p_winograd.define(input, transformed_filter, winograd_shape(input, transformed_filter), winograd_m);
+            p_winograd.schedule(target);
+            out = p_winograd.out;
+        } else if (use_gemm) {
+            p_gemm.define(input, filter, conv_shape(input, filter), 0, 0);
+            p_gemm.schedule(target);
+            out = p_gemm.out;
+        } else {
+            p.define(input, filter, conv_shape(input, filter, 0, 0, sw, sh, pw, ph));
+            p.schedule(target);
+            out = p.out;
+        }
+        input.set(in);
+        sw.set(shape.SW);
+        sh.set(shape.SH);
+        pw.set(shape.PW);
+        ph.set(shape.PH);
+        filter.set(fil);
+        transformed_filter.set(U);
+        use_allocator(out);
+        out.compile_jit(target);
+        run = [&]() { out.realize(output_halide); };
+    } else if (winograd_m == 2) {
+        run = [&]() { halide_winograd_conv_f2(in.raw_buffer(), U.raw_buffer(), output_halide.raw_buffer()); };
+    } else if (winograd_m == 4) {
+        run = [&]() { halide_winograd_conv_f4(in.raw_buffer(), U.raw_buffer(), output_halide.raw_buffer()); };
+    } else if (use_gemm) {
+        run = [&]() { halide_im2col_conv(in.raw_buffer(), fil.raw_buffer(), 0, 0, output_halide.raw_buffer()); };
+    } else {
+        run = [&]() { halide_conv(in.raw_buffer(), fil.raw_buffer(), shape.SW, shape.SH, shape.PW, shape.PH, output_halide.raw_buffer()); };
+    }
+    run();
+    double t_cold = benchmark_duration_seconds(cold_start, benchmark_now());
+
+    double t_halide = benchmark(10, 10, run);
+    // allocations of one call, once the pools are warm
+    AllocStats alloc_before = alloc_stats();
+    run();
+    AllocStats halide_allocs = alloc_stats() - alloc_before;
+    // the oneDNN wrappers time through this, which also collects its counters
+    PerfSample halide_counters, onednn_counters;
+    auto onednn_timer = [&](const std::function<void()> &op) {
+        double t = fixed_benchmark(op);
+        if (counters) {
+            onednn_counters += measure_counters(op);
+        }
+        return t;
+    };
+    if (counters) {
+        halide_counters = measure_counters(run);
+    }
 
     Buffer<float, 4> output_ref(CO, W, H, N);
     // create and execute a conv primitive using oneDNN
-    double t_onednn = dnnl_dilated_conv_wrapper(in.data(), fil.data(), output_ref.data(), {N, CI, CO, W, H, KW, KH, 0, 0});
+    double t_onednn = dnnl_dilated_conv_wrapper(in.data(), fil.data(), output_ref.data(), shape, onednn_timer);
 
     // check results
-    if (check_equal<float, 4>(output_ref, output_halide)) {
+    if (check_equal<float, 4>(output_ref, output_halide, tol)) {
         printf("Halide results - OK\n");
     } else {
         printf("Halide results - FAIL\n");
@@ -82,8 +185,18 @@ int main(int argc, char **argv) {
 
     float gflops = 2.0f * (N * CO * H * W) * (CI * KH * KW) / 1e9f;
 
+    printf("Halide (%s) cold start: %fms\n", use_jit ? "JIT" : "AOT", t_cold * 1e3);
+    print_alloc_stats("Halide", halide_allocs);
+    if (winograd_m) {
+        printf("Winograd filter transform (once): %fms\n", t_filter * 1e3);
+    }
     printf("Halide: %fms, %f GFLOP/s\n", t_halide * 1e3, (gflops / t_halide));
-    printf("oneDNN: %fms, %f GFLOP/s\n\n", t_onednn * 1e3, (gflops / t_onednn));
+    printf("oneDNN: %fms, %f GFLOP/s\n", t_onednn * 1e3, (gflops / t_onednn));
+    if (counters) {
+        print_counters("Halide", halide_counters, gflops * 1e9);
+        print_counters("oneDNN", onednn_counters, gflops * 1e9);
+    }
+    printf("\n");
 
     printf("Success!\n");
 
@@ -0,0 +1,72 @@
+#ifndef CONV_PIPELINE_H
+#define CONV_PIPELINE_H
+
+#include "Halide.h"
+#include "pipeline_common.h"
+
+using namespace Halide;
+
+// Direct 2D convolution, (c, x, y, n) layout, with stride and zero padding.
+// Shared by the JIT path in conv.cpp and the AOT generator in generators.cpp.
+class ConvPipeline {
+ public:
+    Var x{"x"}, y{"y"}, c{"c"}, n{"n"};
+    Var co{"co"}, ci{"ci"}, xo{"xo"}, xi{"xi"};
+    Func conv{"conv"}, out{"out"};
+    Func input, filter;
+    ConvShape shape;
+    RDom r;
+
+    // define convolution algorithm
+    void define(Func input, Func filter, const ConvShape &shape) {
+        this->input = input;
+        this->filter = filter;
+        this->shape = shape;
+        r = RDom(0, shape.CI, 0, shape.KW, 0, shape.KH);
+
+        Func padded = zero_pad(input, shape);
+        conv(c, x, y, n) = 0.0f;
+        conv(c, x, y, n) += filter(c, r.y, r.z, r.x) *
+                            padded(r.x, x * shape.SW + r.y - shape.PW, y * shape.SH + r.z - shape.PH, n);
+
+        out(c, x, y, n) = conv(c, x, y, n);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = target.natural_vector_size<float>();
+        int tile_w = 3;
+        int tile_h = 4;
+        specialize_output_tiles(out, vec, tile_w, tile_h, [&](Stage stage, int c_tile, TailStrategy tail) {
+            stage.split(c, co, ci, c_tile, tail)
+                .split(x, xo, xi, tile_h, tail)
+                .reorder(ci, xi, xo, y, n, co)
+                .vectorize(ci, vec)
+                .unroll(ci)
+                .unroll(xi)
+                .parallel(y)
+                .parallel(n)
+                .parallel(co);
+        });
+        // the tiles are exact multiples of vec except in the guarded
+        // fallback, where GuardWithIf keeps the reads inside the filter
+        conv.compute_at(out, xo)
+            .vectorize(c, vec)
+            .unroll(c)
+            .unroll(x)
+            .unroll(y)
+            .update()
+            .reorder(c, x, y, r.x, r.y, r.z, n)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .unroll(c)
+            .unroll(x)
+            .unroll(y)
+            .unroll(r.x, 2);
+        filter.in().compute_at(conv, r.x).vectorize(_0, vec, TailStrategy::GuardWithIf).unroll(_0).unroll(_3);
+        input.in().compute_at(conv, x).unroll(_0);
+
+        // stride 1 without padding indexes and loads exactly as before
+        conv.update().specialize(is_dense(shape));
+    }
+};
+
+#endif
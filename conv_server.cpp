@@ -0,0 +1,359 @@
+#include "Halide.h"
+#include "common.h"
+#include "pool_allocator.h"
+#include "threading.h"
+#include "conv_server.h"
+#include "dilated_conv_pipeline.h"
+#include "halide_dilated_conv.h"
+#include "halide_dilated_conv_bias.h"
+
+#include <signal.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+using namespace Halide;
+using namespace Halide::Tools;
+
+// A long-running inference server for the dilated_conv and op_fuse layers,
+// with its load generator. The server compiles (or links) both kernels and
+// loads their weights once, then serves requests of a few images each over a
+// Unix domain socket (see conv_server.h for the protocol), batching the
+// concurrent requests of a model along N.
+//
+//   conv_server [--socket PATH] [--max-delay MS] [--check] [DW [DH]]
+//   conv_server --load [--socket PATH] [--clients C] [--requests R] [--images I] [--model NAME|mixed]
+//
+// op_fuse is served in its inference form, the batchnorm folded into the
+// conv as in op_fuse --inference: batch statistics would make a reply depend
+// on the other requests of its batch.
+
+static std::atomic<bool> stop_server{false};
+
+// A layer, its weights and its kernel. The JIT pipeline is compiled once, for
+// every batch size.
+struct ServedModel {
+    ConvConfig shape;  // N is the images of the current call
+    Buffer<float, 4> filter;
+    // op_fuse: the folded filter and bias, and the running statistics for the check
+    bool folded = false;
+    Buffer<float, 4> filter_folded;
+    Buffer<float, 1> bias, mean, variance, scale, shift;
+
+    ImageParam input{type_of<float>(), 4}, filter_param{type_of<float>(), 4}, bias_param{type_of<float>(), 1};
+    Param<int> dw{"DW"}, dh{"DH"};
+    DilatedConvPipeline p;
+    std::unique_ptr<Batcher> batcher;
+};
+
+static const float epsilon = 1.e-9f;
+
+static int run_server(const std::string &socket_path, ConvConfig shape, double max_delay, bool use_jit, bool check,
+                      const Tolerance &tol) {
+    const int max_batch = shape.N;
+    std::mutex check_mutex;
+    uint64_t check_failures = 0;
+    ServedModel models[conv_server_models];
+
+    ServerHello hello = {conv_server_magic, (uint32_t)max_batch, {}};
+    for (int m = 0; m < conv_server_models; m++) {
+        ServedModel &model = models[m];
+        model.shape = shape;
+        model.folded = m == 1;
+        model.filter = Buffer<float, 4>(shape.CO, shape.KW, shape.KH, shape.CI);
+        random_data<float, 4>(model.filter);
+        if (model.folded) {
+            // running statistics of the same order as those of the conv output, as in op_fuse
+            const float taps = shape.CI * shape.KW * shape.KH;
+            for (auto *b : {&model.mean, &model.variance, &model.scale, &model.shift, &model.bias}) {
+                *b = Buffer<float, 1>(shape.CO);
+                random_data<float, 1>(*b);
+            }
+            model.mean.for_each_value([&](float &v) { v = taps * (0.2f + 0.1f * v); });
+            model.variance.for_each_value([&](float &v) { v = taps * (0.04f + 0.04f * v); });
+            model.filter_folded = Buffer<float, 4>(shape.CO, shape.KW, shape.KH, shape.CI);
+            fold_batch_norm(model.filter, model.mean, model.variance, model.scale, model.shift, epsilon,
+                            model.filter_folded, model.bias);
+        }
+        Buffer<float, 4> &weights = model.folded ? model.filter_folded : model.filter;
+
+        if (use_jit) {
+            Target target = get_jit_target_from_environment();
+            model.p.define(model.input, model.filter_param, conv_shape(model.input, model.filter_param, model.dw, model.dh),
+                           model.dw, model.dh, model.folded ? Func(model.bias_param) : Func());
+            model.p.schedule(target);
+            model.filter_param.set(weights);
+            if (model.folded) {
+                model.bias_param.set(model.bias);
+            }
+            model.dw.set(shape.DW);
+            model.dh.set(shape.DH);
+            use_allocator(model.p.out);
+            model.p.out.compile_jit(target);
+        }
+
+        const int IW = shape.input_w(), IH = shape.input_h();
+        hello.models[m] = {(uint32_t)(shape.CI * IW * IH), (uint32_t)(shape.CO * shape.W * shape.H)};
+        auto kernel = [&, m, IW, IH](int images, float *in, float *out) {
+            ServedModel &model = models[m];
+            const ConvConfig &c = model.shape;
+            Buffer<float, 4> in_buffer(in, c.CI, IW, IH, images);
+            Buffer<float, 4> out_buffer(out, c.CO, c.W, c.H, images);
+            if (use_jit) {
+                model.input.set(in_buffer);
+                model.p.out.realize(out_buffer);
+            } else if (model.folded) {
+                halide_dilated_conv_bias(in_buffer.raw_buffer(), model.filter_folded.raw_buffer(),
+                                         model.bias.raw_buffer(), c.DW, c.DH, out_buffer.raw_buffer());
+            } else {
+                halide_dilated_conv(in_buffer.raw_buffer(), model.filter.raw_buffer(), c.DW, c.DH, 1, 1, 0, 0,
+                                    out_buffer.raw_buffer());
+            }
+            if (check) {
+                // oneDNN on the same batch
+                ConvConfig batch = c;
+                batch.N = images;
+                Buffer<float, 4> output_ref(c.CO, c.W, c.H, images);
+                auto once = [](const std::function<void()> &op) {
+                    op();
+                    return 0.0;
+                };
+                dnnl_dilated_conv_wrapper(in, model.filter.data(), output_ref.data(), batch, once);
+                if (model.folded) {
+                    dnnl_batch_normalization_inference_wrapper(output_ref.data(), model.mean.data(),
+                                                               model.variance.data(), model.scale.data(),
+                                                               model.shift.data(), epsilon,
+                                                               {images, c.CO, c.H, c.W}, once);
+                }
+                if (!check_equal<float, 4>(output_ref, out_buffer, tol)) {
+                    std::lock_guard<std::mutex> lock(check_mutex);
+                    printf("%s: batch of %d images - FAIL\n", conv_server_model_names[m], images);
+                    check_failures++;
+                }
+            }
+        };
+        model.batcher.reset(new Batcher(max_batch, hello.models[m].in_floats, hello.models[m].out_floats,
+                                        max_delay, kernel));
+    }
+
+    int listen_fd = listen_unix(socket_path);
+    if (listen_fd < 0) {
+        return 1;
+    }
+    printf("listening on %s: batches of up to %d images, %g ms deadline\n", socket_path.c_str(), max_batch,
+           max_delay * 1e3);
+    for (int m = 0; m < conv_server_models; m++) {
+        printf("  %s: %u floats in, %u floats out per image\n", conv_server_model_names[m],
+               hello.models[m].in_floats, hello.models[m].out_floats);
+    }
+    fflush(stdout);
+
+    // one thread per connection, reading its requests in turn; on shutdown
+    // the connections are closed and their threads waited for
+    std::mutex connections_mutex;
+    std::condition_variable connections_done;
+    std::vector<int> connections;
+    auto serve = [&](int fd) {
+        std::vector<float> in, out;
+        RequestHeader request;
+        bool ok = write_full(fd, &hello, sizeof(hello));
+        while (ok && read_full(fd, &request, sizeof(request))) {
+            if (request.magic != conv_server_magic || request.model >= (uint32_t)conv_server_models ||
+                request.images < 1 || request.images > (uint32_t)max_batch) {
+                ResponseHeader response = {1, 0};
+                write_full(fd, &response, sizeof(response));
+                break;
+            }
+            const ModelInfo &info = hello.models[request.model];
+            in.resize((size_t)request.images * info.in_floats);
+            out.resize((size_t)request.images * info.out_floats);
+            if (!read_full(fd, in.data(), in.size() * sizeof(float))) {
+                break;
+            }
+            int batch = models[request.model].batcher->submit(in.data(), out.data(), request.images);
+            ResponseHeader response = {0, (uint32_t)batch};
+            ok = write_full(fd, &response, sizeof(response)) && write_full(fd, out.data(), out.size() * sizeof(float));
+        }
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.erase(std::find(connections.begin(), connections.end(), fd));
+        close(fd);
+        connections_done.notify_all();
+    };
+    while (!stop_server) {
+        pollfd p = {listen_fd, POLLIN, 0};
+        if (poll(&p, 1, 100) <= 0) {
+            continue;
+        }
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(connections_mutex);
+        connections.push_back(fd);
+        std::thread(serve, fd).detach();
+    }
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    {
+        std::unique_lock<std::mutex> lock(connections_mutex);
+        for (int fd : connections) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        connections_done.wait(lock, [&]() { return connections.empty(); });
+    }
+
+    for (int m = 0; m < conv_server_models; m++) {
+        uint64_t batches, images;
+        models[m].batcher->stats(batches, images);
+        printf("%s: %llu images in %llu batches, %.2f images per batch\n", conv_server_model_names[m],
+               (unsigned long long)images, (unsigned long long)batches, batches ? (double)images / batches : 0.0);
+    }
+    if (check) {
+        printf("check: %s\n", check_failures ? "FAIL" : "OK");
+    }
+    return check_failures ? 1 : 0;
+}
+
+// Closed-loop load: each client has one request in flight and sends the
+// next as soon as the reply is back.
+static int run_load(const std::string &socket_path, int clients, int requests, int images, int model) {
+    std::mutex mutex;
+    std::vector<double> latencies;
+    uint64_t batch_images = 0;
+    int failures = 0;
+
+    auto start = benchmark_now();
+    std::vector<std::thread> threads;
+    for (int client = 0; client < clients; client++) {
+        threads.emplace_back([&, client]() {
+            ServerHello hello = {};
+            int fd = connect_unix(socket_path);
+            if (fd < 0 || !read_full(fd, &hello, sizeof(hello)) || hello.magic != conv_server_magic ||
+                (uint32_t)images > hello.max_batch) {
+                if (fd >= 0) {
+                    printf("client %d: bad server hello, or --images above the batch of %u\n", client, hello.max_batch);
+                    close(fd);
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                failures++;
+                return;
+            }
+            std::vector<double> mine;
+            uint64_t mine_batch = 0;
+            std::vector<float> in, out;
+            for (int i = 0; i < requests; i++) {
+                // mixed load alternates the models, out of phase across clients
+                const uint32_t m = model >= 0 ? model : (client + i) % conv_server_models;
+                const ModelInfo &info = hello.models[m];
+                in.resize((size_t)images * info.in_floats);
+                out.resize((size_t)images * info.out_floats);
+                random_fill(in.data(), 0, in.size(), RandomDistribution(), client * requests + i);
+
+                RequestHeader request = {conv_server_magic, m, (uint32_t)images};
+                ResponseHeader response;
+                auto t0 = benchmark_now();
+                bool ok = write_full(fd, &request, sizeof(request)) &&
+                          write_full(fd, in.data(), in.size() * sizeof(float)) &&
+                          read_full(fd, &response, sizeof(response)) && response.status == 0 &&
+                          read_full(fd, out.data(), out.size() * sizeof(float));
+                if (!ok) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failures++;
+                    break;
+                }
+                mine.push_back(benchmark_duration_seconds(t0, benchmark_now()));
+                mine_batch += response.batch;
+            }
+            close(fd);
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies.insert(latencies.end(), mine.begin(), mine.end());
+            batch_images += mine_batch;
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double t_total = benchmark_duration_seconds(start, benchmark_now());
+
+    if (latencies.empty()) {
+        printf("no request completed\n");
+        return 1;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    // nearest rank
+    auto percentile = [&](double q) {
+        size_t rank = (size_t)std::ceil(q * latencies.size());
+        return latencies[std::max<size_t>(rank, 1) - 1];
+    };
+    const size_t done = latencies.size();
+    printf("%d clients, %zu requests of %d images, %d failed\n", clients, done, images, failures);
+    printf("latency: p50 %fms, p99 %fms, max %fms\n", percentile(0.5) * 1e3, percentile(0.99) * 1e3,
+           latencies.back() * 1e3);
+    printf("throughput: %f requests/s, %f images/s\n", done / t_total, done * images / t_total);
+    printf("batch: %.2f images on average, as seen by a request\n", (double)batch_images / done);
+    return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    // --load runs the load generator against a running server
+    const bool load = take_flag(argc, argv, "--load");
+    const std::string socket_path = take_option(argc, argv, "--socket", "conv_server.sock");
+    if (load) {
+        const int clients = atoi(take_option(argc, argv, "--clients", "16"));
+        const int requests = atoi(take_option(argc, argv, "--requests", "50"));
+        const int images = atoi(take_option(argc, argv, "--images", "1"));
+        // a model name, or mixed for both
+        const std::string name = take_option(argc, argv, "--model", "mixed");
+        int model = -1;
+        for (int m = 0; m < conv_server_models; m++) {
+            if (name == conv_server_model_names[m]) {
+                model = m;
+            }
+        }
+        if ((model < 0 && name != "mixed") || clients < 1 || requests < 1 || images < 1) {
+            printf("--model expects dilated_conv, op_fuse or mixed; --clients, --requests and --images positive\n");
+            return 1;
+        }
+        return run_load(socket_path, clients, requests, images, model);
+    }
+
+    // --threads, --pin and --numa size and place the Halide and oneDNN thread
+    // pools; this runs before any buffer is allocated (see threading.h)
+    ThreadConfig threading;
+    if (!take_threading(argc, argv, threading)) {
+        return 1;
+    }
+    print_threading(threading);
+    // --alloc system|pool|huge picks the allocator of the Halide intermediates (see pool_allocator.h)
+    if (!take_allocator(argc, argv)) {
+        return 1;
+    }
+    // --shape N,CI,CO,W,H,KW,KH of both layers, N the largest batch
+    ConvConfig shape = {};
+    if (!parse_conv_shape(take_option(argc, argv, "--shape", "8,128,128,100,80,3,3"), shape)) {
+        printf("--shape expects N,CI,CO,W,H,KW,KH\n");
+        return 1;
+    }
+    // --max-delay is how long a request may wait for others to join its batch
+    const double max_delay = atof(take_option(argc, argv, "--max-delay", "2")) / 1e3;
+    // --check compares every batch with oneDNN, for testing the batching
+    const bool check = take_flag(argc, argv, "--check");
+    const Tolerance tol = take_tolerance(argc, argv);
+    // the AOT kernels from generators.cpp are the default, --jit builds the pipelines at runtime
+    const bool use_jit = take_flag(argc, argv, "--jit");
+    // dilation is fixed for the life of the server; DH defaults to DW
+    shape.DW = (argc > 1) ? atoi(argv[1]) : 31;
+    shape.DH = (argc > 2) ? atoi(argv[2]) : shape.DW;
+    printf("dilation: %d x %d\n", shape.DW, shape.DH);
+
+    // SIGINT and SIGTERM stop accepting, finish the requests in flight and
+    // print the batching statistics
+    struct sigaction action = {};
+    action.sa_handler = [](int) { stop_server = true; };
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    return run_server(socket_path, shape, max_delay, use_jit, check, tol);
+}
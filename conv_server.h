@@ -0,0 +1,246 @@
+#ifndef CONV_SERVER_H
+#define CONV_SERVER_H
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Wire protocol of conv_server, over a Unix domain stream socket; the peers
+// are on the same machine, so the fields are in native byte order. On
+// connect the server sends a ServerHello. The client then sends requests, a
+// RequestHeader followed by images * in_floats floats, and reads the
+// replies in the same order, a ResponseHeader followed by images * out_floats
+// floats. An image is one (c, x, y) slice of the (c, x, y, n) tensors.
+
+static constexpr uint32_t conv_server_magic = 0x31435643;  // "CVC1"
+
+// the models a server runs, by index
+static constexpr int conv_server_models = 2;
+static const char *const conv_server_model_names[conv_server_models] = {"dilated_conv", "op_fuse"};
+
+struct ModelInfo {
+    uint32_t in_floats, out_floats;  // per image
+};
+
+struct ServerHello {
+    uint32_t magic;
+    uint32_t max_batch;  // images per kernel call, and so per request
+    ModelInfo models[conv_server_models];
+};
+
+struct RequestHeader {
+    uint32_t magic;
+    uint32_t model;
+    uint32_t images;
+};
+
+struct ResponseHeader {
+    uint32_t status;  // 0, or 1 for a bad request, after which the server closes the connection
+    uint32_t batch;   // images of the kernel call the request ran in
+};
+
+inline bool read_full(int fd, void *data, size_t bytes) {
+    char *p = (char *)data;
+    while (bytes > 0) {
+        ssize_t n = recv(fd, p, bytes, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+inline bool write_full(int fd, const void *data, size_t bytes) {
+    const char *p = (const char *)data;
+    while (bytes > 0) {
+        ssize_t n = send(fd, p, bytes, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+inline bool unix_address(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        printf("%s: socket path too long\n", path.c_str());
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+// A listening socket at `path`, replacing a stale one; -1 on failure.
+inline int listen_unix(const std::string &path) {
+    sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || !unix_address(path, addr)) {
+        return -1;
+    }
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        printf("%s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// A connection to the server at `path`; -1 on failure.
+inline int connect_unix(const std::string &path) {
+    sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || !unix_address(path, addr)) {
+        return -1;
+    }
+    if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("%s: %s\n", path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Dynamic batching for one model. Connections submit requests of a few
+// images and block until they are done; a worker thread concatenates the
+// queued requests along N and runs the kernel once for all of them. A batch
+// starts when it holds max_batch images, or when its oldest request has
+// waited max_delay, whichever comes first: under light load a request pays
+// at most max_delay for batching, under heavy load the kernel runs full
+// batches.
+class Batcher {
+ public:
+    using Clock = std::chrono::steady_clock;
+    // runs `images` images from `in` to `out`, both dense (c, x, y, n)
+    using Kernel = std::function<void(int images, float *in, float *out)>;
+
+    Batcher(int max_batch, size_t in_floats, size_t out_floats, double max_delay, Kernel kernel)
+        : max_batch_(max_batch), in_floats_(in_floats), out_floats_(out_floats),
+          max_delay_(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(max_delay))),
+          kernel_(kernel), in_(max_batch * in_floats), out_(max_batch * out_floats) {
+        worker_ = std::thread([this]() { loop(); });
+    }
+
+    // finishes the queued requests first
+    ~Batcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        worker_.join();
+    }
+
+    // Runs `images` (at most max_batch) images, returning once `output` is
+    // written; returns the number of images of the batch they ran in.
+    int submit(const float *input, float *output, int images) {
+        Request r{input, output, images, Clock::now(), {}};
+        std::future<int> done = r.done.get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(&r);
+            queued_images_ += images;
+        }
+        cv_.notify_all();
+        return done.get();
+    }
+
+    // kernel calls and the images they ran
+    void stats(uint64_t &batches, uint64_t &images) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batches = batches_;
+        images = images_;
+    }
+
+ private:
+    struct Request {
+        const float *input;
+        float *output;
+        int images;
+        Clock::time_point arrival;
+        std::promise<int> done;
+    };
+
+    const int max_batch_;
+    const size_t in_floats_, out_floats_;
+    const Clock::duration max_delay_;
+    Kernel kernel_;
+    std::vector<float> in_, out_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Request *> queue_;
+    int queued_images_ = 0;
+    bool stop_ = false;
+    uint64_t batches_ = 0, images_ = 0;
+    std::thread worker_;
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            cv_.wait(lock, [&]() { return stop_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            const Clock::time_point deadline = queue_.front()->arrival + max_delay_;
+            cv_.wait_until(lock, deadline, [&]() { return stop_ || queued_images_ >= max_batch_; });
+
+            // the oldest requests that fit, in arrival order
+            std::vector<Request *> batch;
+            int images = 0;
+            while (!queue_.empty() && images + queue_.front()->images <= max_batch_) {
+                batch.push_back(queue_.front());
+                images += queue_.front()->images;
+                queue_.pop_front();
+            }
+            queued_images_ -= images;
+            lock.unlock();
+
+            size_t offset = 0;
+            for (Request *r : batch) {
+                memcpy(&in_[offset * in_floats_], r->input, r->images * in_floats_ * sizeof(float));
+                offset += r->images;
+            }
+            kernel_(images, in_.data(), out_.data());
+            offset = 0;
+            for (Request *r : batch) {
+                memcpy(r->output, &out_[offset * out_floats_], r->images * out_floats_ * sizeof(float));
+                offset += r->images;
+                r->done.set_value(images);
+            }
+
+            lock.lock();
+            batches_++;
+            images_ += images;
+        }
+    }
+};
+
+#endif
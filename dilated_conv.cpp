@@ -1,108 +1,365 @@
 #include "Halide.h"
+#include "autotune.h"
 #include "common.h"
+#include "perf_counters.h"
+#include "pool_allocator.h"
+#include "threading.h"
+#include "dilated_conv_pipeline.h"
+#include "dilated_conv_s2b_pipeline.h"
+#include "blocked_conv_pipeline.h"
+#include "grouped_conv_pipeline.h"
+#include "im2col_conv_pipeline.h"
+#include "halide_dilated_conv.h"
+#include "halide_dilated_conv_s2b.h"
+#include "halide_blocked_conv_8c.h"
+#include "halide_blocked_conv_16c.h"
+#include "halide_depthwise_conv.h"
+#include "halide_grouped_conv.h"
+#include "halide_im2col_conv.h"
 
 #include <stdio.h>
 
 using namespace Halide;
 using namespace Halide::Tools;
 
-int main(int argc, char **argv) {
-    const int N = 5, CI = 128, CO = 128, W = 100, H = 80, KW = 3, KH = 3;
-    const int dilation = (argc > 1) ? atoi(argv[1]) : 31;
+// Search space of DilatedConvSchedule, in the order of DilatedConvSchedule::params().
+const ScheduleSpace dilated_conv_space = {
+    {"tile_w", "tile_h", "unroll_rx", "parallel_depth", "input_at", "filter_at"},
+    {{1, 2, 3, 4, 6}, {1, 2, 4, 6, 8}, {1, 2, 4}, {1, 2, 3}, {0, 1, 2}, {0, 1, 2}},
+};
 
+// Compiles the pipeline with `sched` and times it on the given buffers; `c`
+// gives the dilation, stride and padding.
+double time_schedule(const DilatedConvSchedule &sched, Buffer<float, 4> &in, Buffer<float, 4> &fil,
+                     Buffer<float, 4> &output, const ConvConfig &c, const Target &target) {
+    // input.in() and filter.in() are owned by the ImageParams, so every
+    // candidate needs fresh ones to start from an empty schedule
     ImageParam input(type_of<float>(), 4);
     ImageParam filter(type_of<float>(), 4);
+    Param<int> dw("DW"), dh("DH"), sw("SW"), sh("SH"), pw("PW"), ph("PH");
+    DilatedConvPipeline p;
+    p.define(input, filter, conv_shape(input, filter, dw, dh, sw, sh, pw, ph), dw, dh);
+    p.schedule(target, sched);
+    input.set(in);
+    filter.set(fil);
+    dw.set(c.DW);
+    dh.set(c.DH);
+    sw.set(c.SW);
+    sh.set(c.SH);
+    pw.set(c.PW);
+    ph.set(c.PH);
+    try {
+        p.out.compile_jit(target);
+        p.out.realize(output);
+    } catch (const Halide::Error &e) {
+        return std::numeric_limits<double>::infinity();
+    }
 
-    // define dilated convolution
-    // you can also rewrite algorithm definition part, as long as results are correct
-    Var x("x"), y("y"), c("c"), n("n");
+    BenchmarkConfig config;
+    config.min_time = 0.05;
+    config.max_time = 0.5;
+    return benchmark([&]() { p.out.realize(output); }, config);
+}
 
-    Func dilated_conv("dilated_conv"), out("out");
-    RDom r(0, CI, 0, KW, 0, KH);
+int main(int argc, char **argv) {
+    // --threads, --pin and --numa size and place the Halide and oneDNN thread
+    // pools; this runs before any buffer is allocated (see threading.h)
+    ThreadConfig threading;
+    if (!take_threading(argc, argv, threading)) {
+        return 1;
+    }
+    print_threading(threading);
+    // --alloc system|pool|huge picks the allocator of the Halide intermediates (see pool_allocator.h)
+    if (!take_allocator(argc, argv)) {
+        return 1;
+    }
+    // the pipelines read the layer shape from their buffers, --shape N,CI,CO,W,H,KW,KH overrides the default
+    ConvConfig shape = {};
+    if (!parse_conv_shape(take_option(argc, argv, "--shape", "5,128,128,100,80,3,3"), shape)) {
+        printf("--shape expects N,CI,CO,W,H,KW,KH\n");
+        return 1;
+    }
+    const int N = shape.N, CI = shape.CI, CO = shape.CO, W = shape.W, H = shape.H, KW = shape.KW, KH = shape.KH;
+    // --stride and --pad (see parse_stride_padding) apply to the direct schedule
+    // only; "same" padding depends on the dilation, parsed last
+    const char *stride = take_option(argc, argv, "--stride", "1");
+    const char *pad = take_option(argc, argv, "--pad", "0");
+    // --autotune searches the schedule for this shape and dilation and stores
+    // the winner in the schedule cache, which later --jit runs load
+    const bool autotune = take_flag(argc, argv, "--autotune");
+    const int trials = atoi(take_option(argc, argv, "--autotune-trials", "40"));
+    ScheduleCache cache(take_option(argc, argv, "--schedule-cache", "dilated_conv.schedules"));
+    // --counters also reports hardware counters (perf_event_open) of both runs
+    const bool counters = take_flag(argc, argv, "--counters");
+    // --atol, --rtol and --ulp set the tolerances of the result check
+    const Tolerance tol = take_tolerance(argc, argv);
+    // the AOT kernel from generators.cpp is the default, --jit builds the pipeline at runtime
+    const bool use_jit = take_flag(argc, argv, "--jit") || autotune;
+    // --algo picks direct, space-to-batch (s2b) or im2col + GEMM (gemm); auto
+    // asks the cost heuristic to choose between direct and s2b
+    const std::string algo = take_option(argc, argv, "--algo", "auto");
+    if (algo != "auto" && algo != "direct" && algo != "s2b" && algo != "gemm") {
+        printf("--algo expects auto, direct, s2b or gemm\n");
+        return 1;
+    }
+    if (autotune && algo != "auto" && algo != "direct") {
+        printf("--autotune searches the direct schedule only: use --algo direct or auto\n");
+        return 1;
+    }
+    // --groups G splits CI and CO into G groups, run by the grouped conv
+    // pipeline; G = CI = CO is a depthwise conv, which has its own
+    shape.groups = atoi(take_option(argc, argv, "--groups", "1"));
+    const int groups = shape.groups;
+    const bool grouped = groups > 1;
+    const bool depthwise = shape.is_depthwise();
+    if (groups < 1 || CI % groups != 0 || CO % groups != 0) {
+        printf("--groups must divide CI and CO\n");
+        return 1;
+    }
+    // --layout nChw8c or nChw16c runs the direct conv on blocked channel
+    // layouts, which oneDNN takes without reorders (see blocked_conv_pipeline.h)
+    const std::string layout = take_option(argc, argv, "--layout", "nhwc");
+    shape.block = layout == "nChw8c" ? 8 : layout == "nChw16c" ? 16 : 0;
+    const int block = shape.block;
+    const bool blocked = block > 0;
+    if (!blocked && layout != "nhwc") {
+        printf("--layout expects nhwc, nChw8c or nChw16c\n");
+        return 1;
+    }
+    if (blocked && (grouped || autotune || (algo != "auto" && algo != "direct") || CI % block != 0 || CO % block != 0)) {
+        printf("--layout %s needs --algo direct, no groups or --autotune, and CI and CO multiples of %d\n",
+               layout.c_str(), block);
+        return 1;
+    }
+    // dilation is a runtime parameter of the compiled pipeline; DH defaults to DW
+    const int DW = (argc > 1) ? atoi(argv[1]) : 31;
+    const int DH = (argc > 2) ? atoi(argv[2]) : DW;
+    shape.DW = DW;
+    shape.DH = DH;
+    if (!parse_stride_padding(stride, pad, shape)) {
+        return 1;
+    }
+    // the autotuner searches the direct schedule only
+    const bool use_gemm = !autotune && algo == "gemm";
+    const int vec = get_jit_target_from_environment().natural_vector_size<float>();
+    const bool auto_s2b = algo == "auto" && !grouped && !blocked && shape.is_dense() &&
+                          prefer_space_to_batch(CI, CO, W, H, KW, KH, DW, DH, vec, cache_sizes().l2);
+    const bool use_s2b = !autotune && (algo == "s2b" || auto_s2b);
+    if (grouped && (autotune || use_gemm || use_s2b)) {
+        printf("--groups needs --algo direct and no --autotune\n");
+        return 1;
+    }
+    if ((use_gemm || use_s2b) && !shape.is_dense()) {
+        printf("--algo %s needs stride 1 and no padding\n", algo.c_str());
+        return 1;
+    }
 
-    dilated_conv(c, x, y, n) = 0.0f;
-    dilated_conv(c, x, y, n) += filter(c, r.y, r.z, r.x) * input(r.x, x + r.y * (dilation + 1), y + r.z * (dilation + 1), n);
-    out(c, x, y, n) = dilated_conv(c, x, y, n);
-    printf("dilation: %d\n", dilation);
-    // TODO: write Halide schedules below
-    // 获取目标设备向量宽度
-    Target target = get_jit_target_from_environment();
-    const int vec = target.natural_vector_size<float>();
-
-    // 调整块大小
-    const int tile_w = 4;
-    const int tile_h = 4;
-
-    Var co("co"), ci("ci"), xo("xo"), xi("xi"), yo("yo"), yi("yi"), t("t");
-
-    // 主函数 out 的调度
-    out.split(c, co, ci, vec * tile_w)
-        .split(x, xo, xi, tile_h)
-        .reorder(ci, xi, xo, y, n, co)
-        .vectorize(ci, vec)        // 按自然向量宽度进行向量化
-        .unroll(ci)               // 对小范围的 `ci` 展开
-        .unroll(xi)               // 展开块内的 x
-        .parallel(y)              // 对输出的 y 维度并行化
-        .parallel(n)              // 对批次并行化
-        .parallel(co);            // 并行处理通道块
-
-    // 中间计算 dilated_conv 的调度
-    dilated_conv.compute_at(out, xo)
-        .vectorize(c, vec)        // 按 c 向量化
-        .unroll(c)                // 对 c 展开
-        .unroll(x)                // 展开 x 块
-        .unroll(y)                // 展开 y 块
-        .update()
-        .reorder(c, x, y, r.x, r.y, r.z, n)
-        .vectorize(c, vec)        // 归约计算的向量化
-        .unroll(c)                // 对 c 展开
-        .unroll(x)                // 对 x 展开
-        .unroll(y)                // 对 y 展开
-        .unroll(r.x, 2);          // 对 r.x 进行展开
-
-    // 数据预处理的调度
-    filter.in().compute_at(dilated_conv, r.x)
-        .vectorize(_0, vec)       // 卷积核向量化
-        .unroll(_0)               // 展开内部维度
-        .unroll(_3);              // 展开通道维度
-
-    input.in().compute_at(dilated_conv, x)
-        .unroll(_0);              // 对通道展开
-
-    
-
-    Buffer<float, 4> in(CI, W + (KW - 1) * (dilation + 1), H + (KH - 1) * (dilation + 1), N);
-    Buffer<float, 4> fil(CO, KW, KH, CI);
+    ImageParam input(type_of<float>(), 4);
+    ImageParam filter(type_of<float>(), 4);
+    ImageParam input_blocked(type_of<float>(), 5);
+    ImageParam filter_blocked(type_of<float>(), 6);
+    Param<int> dw("DW"), dh("DH"), sw("SW"), sh("SH"), pw("PW"), ph("PH"), g("groups");
+    DilatedConvPipeline p;
+    BlockedConvPipeline p_blocked;
+    DilatedConvS2BPipeline p_s2b;
+    Im2colConvPipeline p_gemm;
+    GroupedConvPipeline p_grouped;
+    DepthwiseConvPipeline p_depthwise;
+    Func out;
+
+    printf("dilation: %d x %d\n", DW, DH);
+    printf("stride: %d x %d, padding: %d x %d\n", shape.SW, shape.SH, shape.PW, shape.PH);
+    if (grouped) {
+        printf("algorithm: %s, %d groups\n", depthwise ? "depthwise" : "grouped", groups);
+    } else if (blocked) {
+        printf("algorithm: direct, %s\n", layout.c_str());
+    } else {
+        printf("algorithm: %s\n", use_gemm ? "im2col + GEMM" : use_s2b ? "space-to-batch" : "direct");
+    }
+
+    Buffer<float, 4> in(CI, shape.input_w(), shape.input_h(), N);
+    Buffer<float, 4> fil(CO, KW, KH, CI / groups);
     Buffer<float, 4> output_halide(CO, W, H, N);
+    // the grouped pipeline writes the same memory through a 5-D view
+    Buffer<float, 5> output_grouped = grouped_view(output_halide, groups);
 
     // init randomly
     random_data<float, 4>(in);
     random_data<float, 4>(fil);
-    input.set(in);
-    filter.set(fil);
+    // the blocked tensors, converted once; both engines take them as they are
+    Buffer<float, 5> in_blocked, output_blocked, output_ref_blocked;
+    Buffer<float, 6> fil_blocked;
+    if (blocked) {
+        in_blocked = to_blocked(in, block);
+        fil_blocked = to_blocked_filter(fil, block);
+        output_blocked = Buffer<float, 5>(block, W, H, CO / block, N);
+        output_ref_blocked = Buffer<float, 5>(block, W, H, CO / block, N);
+    }
+
+    Target target = get_jit_target_from_environment();
+    // strided or padded layers get their own entries; dense keys are unchanged
+    std::vector<int> key_shape = {N, CI, CO, W, H, KW, KH, DW, DH};
+    if (!shape.is_dense()) {
+        key_shape.insert(key_shape.end(), {shape.SW, shape.SH, shape.PW, shape.PH});
+    }
+    const std::string key = schedule_key("dilated_conv", key_shape, target);
+    ScheduleParams params = DilatedConvSchedule().params();
+    if (autotune) {
+        printf("autotuning %s\n", key.c_str());
+        double t_best;
+        params = coordinate_descent(dilated_conv_space, params, [&](const ScheduleParams &candidate) {
+            return time_schedule(DilatedConvSchedule::from_params(candidate), in, fil, output_halide, shape, target);
+        }, trials, &t_best);
+        cache.store(key, params, t_best);
+        printf("best schedule: %s\n", describe(dilated_conv_space, params).c_str());
+    } else if (use_jit && !use_gemm && !use_s2b && !grouped && !blocked &&
+               cache.lookup(key, dilated_conv_space, params)) {
+        printf("tuned schedule: %s\n", describe(dilated_conv_space, params).c_str());
+    }
 
-    // jit compile and warm-up
-    out.realize(output_halide);
+    // cold start: pipeline construction, compilation (JIT only) and the first call
+    auto cold_start = benchmark_now();
+    std::function<void()> run;
+    if (use_jit) {
+        if (use_gemm) {
+            p_gemm.define(input, filter, conv_shape(input, filter, dw, dh), dw, dh);
+            p_gemm.schedule(target);
+            out = p_gemm.out;
+        } else if (use_s2b) {
+            p_s2b.define(input, filter, conv_shape(input, filter, dw, dh), dw, dh);
+            p_s2b.schedule(target);
+            out = p_s2b.out;
+        } else if (depthwise) {
+            p_depthwise.define(input, filter, conv_shape(input, filter, dw, dh, sw, sh, pw, ph), dw, dh);
+            p_depthwise.schedule(target);
+            out = p_depthwise.out;
+        } else if (grouped) {
+            p_grouped.define(input, filter, conv_shape(input, filter, dw, dh, sw, sh, pw, ph), dw, dh, g);
+            p_grouped.schedule(target);
+            out = p_grouped.out;
+        } else if (blocked) {
+            p_blocked.define(input_blocked, filter_blocked,
+                             blocked_conv_shape(input_blocked, filter_blocked, dw, dh, sw, sh, pw, ph), block, dw, dh);
+            p_blocked.schedule(target);
+            out = p_blocked.out;
+            input_blocked.set(in_blocked);
+            filter_blocked.set(fil_blocked);
+        } else {
+            p.define(input, filter, conv_shape(input, filter, dw, dh, sw, sh, pw, ph), dw, dh);
+            p.schedule(target, DilatedConvSchedule::from_params(params));
+            out = p.out;
+        }
+        input.set(in);
+        filter.set(fil);
+        dw.set(DW);
+        dh.set(DH);
+        sw.set(shape.SW);
+        sh.set(shape.SH);
+        pw.set(shape.PW);
+        ph.set(shape.PH);
+        g.set(groups);
+        use_allocator(out);
+        out.compile_jit(target);
+        if (grouped && !depthwise) {
+            run = [&]() { out.realize(output_grouped); };
+        } else if (blocked) {
+            run = [&]() { out.realize(output_blocked); };
+        } else {
+            run = [&]() { out.realize(output_halide); };
+        }
+    } else if (use_gemm || use_s2b) {
+        auto kernel = use_gemm ? halide_im2col_conv : halide_dilated_conv_s2b;
+        run = [&, kernel]() { kernel(in.raw_buffer(), fil.raw_buffer(), DW, DH, output_halide.raw_buffer()); };
+    } else if (depthwise) {
+        run = [&]() {
+            halide_depthwise_conv(in.raw_buffer(), fil.raw_buffer(), DW, DH, shape.SW, shape.SH, shape.PW, shape.PH,
+                                  output_halide.raw_buffer());
+        };
+    } else if (blocked) {
+        auto kernel = block == 16 ? halide_blocked_conv_16c : halide_blocked_conv_8c;
+        run = [&, kernel]() {
+            kernel(in_blocked.raw_buffer(), fil_blocked.raw_buffer(), DW, DH, shape.SW, shape.SH, shape.PW, shape.PH,
+                   output_blocked.raw_buffer());
+        };
+    } else if (grouped) {
+        run = [&]() {
+            halide_grouped_conv(in.raw_buffer(), fil.raw_buffer(), groups, DW, DH, shape.SW, shape.SH, shape.PW,
+                                shape.PH, output_grouped.raw_buffer());
+        };
+    } else {
+        run = [&]() {
+            halide_dilated_conv(in.raw_buffer(), fil.raw_buffer(), DW, DH, shape.SW, shape.SH, shape.PW, shape.PH,
+                                output_halide.raw_buffer());
+        };
+    }
+    run();
+    double t_cold = benchmark_duration_seconds(cold_start, benchmark_now());
     // NOTE: uncomment next line if time is unstable
-    // double t_halide = benchmark(10, 10, [&]() { dilated_conv.realize(output_halide); });
-    double t_halide = benchmark(1, 1, [&]() { out.realize(output_halide); });
+    // double t_halide = benchmark(10, 10, run);
+    double t_halide = benchmark(1, 1, run);
+    // allocations of one call, once the pools are warm
+    AllocStats alloc_before = alloc_stats();
+    run();
+    AllocStats halide_allocs = alloc_stats() - alloc_before;
+    // the oneDNN wrappers time through this, which also collects its counters
+    PerfSample halide_counters, onednn_counters;
+    auto onednn_timer = [&](const std::function<void()> &op) {
+        double t = fixed_benchmark(op);
+        if (counters) {
+            onednn_counters += measure_counters(op);
+        }
+        return t;
+    };
+    if (counters) {
+        halide_counters = measure_counters(run);
+    }
 
     Buffer<float, 4> output_ref(CO, W, H, N);
-    // create and execute a dilated conv primitive using oneDNN
-    double t_onednn = dnnl_dilated_conv_wrapper(in.data(), fil.data(), output_ref.data(), {N, CI, CO, W, H, KW, KH, dilation, dilation});
+    // create and execute a dilated conv primitive using oneDNN, on the same
+    // tensors as Halide
+    double t_onednn = blocked ? dnnl_dilated_conv_wrapper(in_blocked.data(), fil_blocked.data(),
+                                                          output_ref_blocked.data(), shape, onednn_timer)
+                              : dnnl_dilated_conv_wrapper(in.data(), fil.data(), output_ref.data(), shape, onednn_timer);
 
     // check results
-    if (check_equal<float, 4>(output_ref, output_halide)) {
+    if (blocked ? check_equal<float, 5>(output_ref_blocked, output_blocked, tol)
+                : check_equal<float, 4>(output_ref, output_halide, tol)) {
         printf("Halide results - OK\n");
     } else {
         printf("Halide results - FAIL\n");
         return 1;
     }
 
-    float gflops = 2.0f * (N * CO * H * W) * (CI * KH * KW) / 1e9f;
+    float gflops = 2.0f * (N * CO * H * W) * (CI / groups * KH * KW) / 1e9f;
 
+    printf("Halide (%s) cold start: %fms\n", use_jit ? "JIT" : "AOT", t_cold * 1e3);
+    print_alloc_stats("Halide", halide_allocs);
     printf("Halide: %fms, %f GFLOP/s\n", t_halide * 1e3, (gflops / t_halide));
-    printf("oneDNN: %fms, %f GFLOP/s\n\n", t_onednn * 1e3, (gflops / t_onednn));
+    printf("oneDNN: %fms, %f GFLOP/s\n", t_onednn * 1e3, (gflops / t_onednn));
+    // the compulsory bytes of input, filter and output
+    double gbytes = 4.0 * (in.number_of_elements() + fil.number_of_elements() + output_halide.number_of_elements()) / 1e9;
+    if (grouped) {
+        // grouped and depthwise layers are bound by memory traffic
+        printf("Halide: %f GB/s, oneDNN: %f GB/s\n", gbytes / t_halide, gbytes / t_onednn);
+    }
+    // what oneDNN's reorders move on top of that, with the tensors of this
+    // run and, for a blocked run, with plain ones
+    printf("bytes moved per call: %.1f MB compulsory\n", gbytes * 1e3);
+    std::vector<std::pair<std::string, ConvConfig>> reorder_layouts = {{layout, shape}};
+    if (blocked) {
+        reorder_layouts.push_back({"nhwc", shape});
+        reorder_layouts.back().second.block = 0;
+    }
+    for (const auto &l : reorder_layouts) {
+        const DnnlConvLayer &layer = dnnl_conv_layer(l.second).layer;
+        printf("oneDNN reorders on %s tensors: %.1f MB per call, and %.1f MB once per filter\n", l.first.c_str(),
+               layer.call_reorder_bytes / 1e6, layer.weights_reorder_bytes / 1e6);
+    }
+    if (counters) {
+        print_counters("Halide", halide_counters, gflops * 1e9);
+        print_counters("oneDNN", onednn_counters, gflops * 1e9);
+    }
+    printf("\n");
 
     printf("Success!\n");
 
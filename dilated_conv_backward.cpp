@@ -0,0 +1,177 @@
+#include "Halide.h"
+#include "common.h"
+#include "perf_counters.h"
+#include "pool_allocator.h"
+#include "threading.h"
+#include "dilated_conv_backward_pipeline.h"
+#include "halide_dilated_conv_backward_data.h"
+#include "halide_dilated_conv_backward_weights.h"
+
+#include <stdio.h>
+
+using namespace Halide;
+using namespace Halide::Tools;
+
+// The backward pass of the dilated conv: the input gradient and the filter
+// gradient from a random output gradient, checked and timed against oneDNN's
+// convolution_backward_data and convolution_backward_weights.
+int main(int argc, char **argv) {
+    // --threads, --pin and --numa size and place the Halide and oneDNN thread
+    // pools; this runs before any buffer is allocated (see threading.h)
+    ThreadConfig threading;
+    if (!take_threading(argc, argv, threading)) {
+        return 1;
+    }
+    print_threading(threading);
+    // --alloc system|pool|huge picks the allocator of the Halide intermediates (see pool_allocator.h)
+    if (!take_allocator(argc, argv)) {
+        return 1;
+    }
+    // the pipelines read the layer shape from their buffers, --shape N,CI,CO,W,H,KW,KH overrides the default
+    ConvConfig shape = {};
+    if (!parse_conv_shape(take_option(argc, argv, "--shape", "5,128,128,100,80,3,3"), shape)) {
+        printf("--shape expects N,CI,CO,W,H,KW,KH\n");
+        return 1;
+    }
+    const int N = shape.N, CI = shape.CI, CO = shape.CO, W = shape.W, H = shape.H, KW = shape.KW, KH = shape.KH;
+    // --stride and --pad (see parse_stride_padding) of the forward layer;
+    // "same" padding depends on the dilation, parsed last
+    const char *stride = take_option(argc, argv, "--stride", "1");
+    const char *pad = take_option(argc, argv, "--pad", "0");
+    // --counters also reports hardware counters (perf_event_open) of both runs
+    const bool counters = take_flag(argc, argv, "--counters");
+    // --atol, --rtol and --ulp set the tolerances of the result check; the
+    // filter gradient sums N * W * H products, so a relative bound as well
+    Tolerance def_tol;
+    def_tol.rel = 1e-4f;
+    const Tolerance tol = take_tolerance(argc, argv, def_tol);
+    // the AOT kernels from generators.cpp are the default, --jit builds the pipelines at runtime
+    const bool use_jit = take_flag(argc, argv, "--jit");
+    // dilation is a runtime parameter of the compiled pipelines; DH defaults to DW
+    const int DW = (argc > 1) ? atoi(argv[1]) : 31;
+    const int DH = (argc > 2) ? atoi(argv[2]) : DW;
+    shape.DW = DW;
+    shape.DH = DH;
+    if (!parse_stride_padding(stride, pad, shape)) {
+        return 1;
+    }
+    const int IW = shape.input_w(), IH = shape.input_h();
+
+    printf("dilation: %d x %d\n", DW, DH);
+    printf("stride: %d x %d, padding: %d x %d\n", shape.SW, shape.SH, shape.PW, shape.PH);
+
+    // forward input and filter, and the gradient of the forward output
+    Buffer<float, 4> in(CI, IW, IH, N);
+    Buffer<float, 4> fil(CO, KW, KH, CI);
+    Buffer<float, 4> dout(CO, W, H, N);
+    random_data<float, 4>(in);
+    random_data<float, 4>(fil);
+    random_data<float, 4>(dout);
+    Buffer<float, 4> din_halide(CI, IW, IH, N), din_ref(CI, IW, IH, N);
+    Buffer<float, 4> dfil_halide(CO, KW, KH, CI), dfil_ref(CO, KW, KH, CI);
+
+    ImageParam input(type_of<float>(), 4), filter(type_of<float>(), 4), output_grad(type_of<float>(), 4);
+    Param<int> dw("DW"), dh("DH"), sw("SW"), sh("SH"), pw("PW"), ph("PH");
+    DilatedConvBackwardDataPipeline p_data;
+    DilatedConvBackwardWeightsPipeline p_weights;
+
+    // cold start: pipeline construction, compilation (JIT only) and the first call of both passes
+    auto cold_start = benchmark_now();
+    std::function<void()> run_data, run_weights;
+    if (use_jit) {
+        Target target = get_jit_target_from_environment();
+        p_data.define(output_grad, filter, backward_data_shape(output_grad, filter, sw, sh, pw, ph), dw, dh);
+        p_data.schedule(target);
+        p_weights.define(input, output_grad, backward_weights_shape(input, output_grad, sw, sh, pw, ph), dw, dh);
+        p_weights.schedule(target);
+        input.set(in);
+        filter.set(fil);
+        output_grad.set(dout);
+        dw.set(DW);
+        dh.set(DH);
+        sw.set(shape.SW);
+        sh.set(shape.SH);
+        pw.set(shape.PW);
+        ph.set(shape.PH);
+        use_allocator(p_data.out);
+        use_allocator(p_weights.out);
+        p_data.out.compile_jit(target);
+        p_weights.out.compile_jit(target);
+        run_data = [&]() { p_data.out.realize(din_halide); };
+        run_weights = [&]() { p_weights.out.realize(dfil_halide); };
+    } else {
+        run_data = [&]() {
+            halide_dilated_conv_backward_data(dout.raw_buffer(), fil.raw_buffer(), DW, DH, shape.SW, shape.SH,
+                                              shape.PW, shape.PH, din_halide.raw_buffer());
+        };
+        run_weights = [&]() {
+            halide_dilated_conv_backward_weights(in.raw_buffer(), dout.raw_buffer(), DW, DH, shape.SW, shape.SH,
+                                                 shape.PW, shape.PH, dfil_halide.raw_buffer());
+        };
+    }
+    run_data();
+    run_weights();
+    double t_cold = benchmark_duration_seconds(cold_start, benchmark_now());
+
+    double t_halide_data = benchmark(10, 10, run_data);
+    double t_halide_weights = benchmark(10, 10, run_weights);
+    // allocations of one call of each pass, once the pools are warm
+    AllocStats alloc_before = alloc_stats();
+    run_data();
+    AllocStats data_allocs = alloc_stats() - alloc_before;
+    alloc_before = alloc_stats();
+    run_weights();
+    AllocStats weights_allocs = alloc_stats() - alloc_before;
+    // the oneDNN wrappers time through this, which also collects its counters
+    PerfSample halide_counters, onednn_counters;
+    auto onednn_timer = [&](const std::function<void()> &op) {
+        double t = fixed_benchmark(op);
+        if (counters) {
+            onednn_counters += measure_counters(op);
+        }
+        return t;
+    };
+    if (counters) {
+        halide_counters = measure_counters(run_data);
+        halide_counters += measure_counters(run_weights);
+    }
+
+    double t_onednn_data = dnnl_dilated_conv_backward_data_wrapper(dout.data(), fil.data(), din_ref.data(), shape, onednn_timer);
+    double t_onednn_weights = dnnl_dilated_conv_backward_weights_wrapper(in.data(), dout.data(), dfil_ref.data(), shape, onednn_timer);
+
+    // check results
+    if (check_equal<float, 4>(din_ref, din_halide, tol)) {
+        printf("Halide input gradient - OK\n");
+    } else {
+        printf("Halide input gradient - FAIL\n");
+        return 1;
+    }
+    if (check_equal<float, 4>(dfil_ref, dfil_halide, tol)) {
+        printf("Halide filter gradient - OK\n");
+    } else {
+        printf("Halide filter gradient - FAIL\n");
+        return 1;
+    }
+
+    // each pass does the multiply-adds of the forward conv
+    float gflops = 2.0f * (N * CO * H * W) * (CI * KH * KW) / 1e9f;
+
+    printf("Halide (%s) cold start: %fms\n", use_jit ? "JIT" : "AOT", t_cold * 1e3);
+    print_alloc_stats("Halide input gradient", data_allocs);
+    print_alloc_stats("Halide filter gradient", weights_allocs);
+    printf("input gradient:\n");
+    printf("  Halide: %fms, %f GFLOP/s\n", t_halide_data * 1e3, (gflops / t_halide_data));
+    printf("  oneDNN: %fms, %f GFLOP/s\n", t_onednn_data * 1e3, (gflops / t_onednn_data));
+    printf("filter gradient:\n");
+    printf("  Halide: %fms, %f GFLOP/s\n", t_halide_weights * 1e3, (gflops / t_halide_weights));
+    printf("  oneDNN: %fms, %f GFLOP/s\n", t_onednn_weights * 1e3, (gflops / t_onednn_weights));
+    if (counters) {
+        print_counters("Halide", halide_counters, 2.0 * gflops * 1e9);
+        print_counters("oneDNN", onednn_counters, 2.0 * gflops * 1e9);
+    }
+    printf("\n");
+
+    printf("Success!\n");
+
+    return 0;
+}
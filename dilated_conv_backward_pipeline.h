@@ -0,0 +1,187 @@
+#ifndef DILATED_CONV_BACKWARD_PIPELINE_H
+#define DILATED_CONV_BACKWARD_PIPELINE_H
+
+#include "Halide.h"
+#include "pipeline_common.h"
+
+using namespace Halide;
+
+// Backward pass of the dilated conv in dilated_conv_pipeline.h, (c, x, y, n)
+// layout, stride and zero padding, no groups. With d = D + 1 the forward is
+//   out(c, x, y, n) = sum filter(c, kx, ky, ci) * in(ci, x * S + kx * d - P, y * S + ky * d - P, n)
+// over ci, kx, ky, so given the output gradient dout:
+//  - the input gradient is a transposed dilated conv of dout,
+//      din(ci, ix, iy, n) = sum filter(c, kx, ky, ci) * dout(c, ox, oy, n)
+//    over c, kx, ky, with ix = ox * S + kx * d - P;
+//  - the weight gradient is a reduction over the batch and the output plane,
+//      dfilter(c, kx, ky, ci) = sum dout(c, ox, oy, n) * in(ci, ox * S + kx * d - P, oy * S + ky * d - P, n).
+
+// Shapes of the two passes: the output gradient gives N, CO, W and H; the
+// filter gives CI, KW and KH to the data gradient, and the input gives CI,
+// IW and IH to the weight gradient. Works for both ImageParam (JIT) and
+// Input<Buffer<>> (generators).
+template <typename InputBuffer>
+inline ConvShape backward_data_shape(const InputBuffer &dout, const InputBuffer &filter,
+                                     Expr SW = 1, Expr SH = 1, Expr PW = 0, Expr PH = 0) {
+    ConvShape s;
+    s.N = dout.dim(3).extent();
+    s.CO = dout.dim(0).extent();
+    s.W = dout.dim(1).extent();
+    s.H = dout.dim(2).extent();
+    s.CI = filter.dim(3).extent();
+    s.KW = filter.dim(1).extent();
+    s.KH = filter.dim(2).extent();
+    s.SW = SW;
+    s.SH = SH;
+    s.PW = PW;
+    s.PH = PH;
+    return s;
+}
+
+template <typename InputBuffer>
+inline ConvShape backward_weights_shape(const InputBuffer &input, const InputBuffer &dout,
+                                        Expr SW = 1, Expr SH = 1, Expr PW = 0, Expr PH = 0) {
+    ConvShape s;
+    s.N = input.dim(3).extent();
+    s.CI = input.dim(0).extent();
+    s.IW = input.dim(1).extent();
+    s.IH = input.dim(2).extent();
+    s.CO = dout.dim(0).extent();
+    s.W = dout.dim(1).extent();
+    s.H = dout.dim(2).extent();
+    s.SW = SW;
+    s.SH = SH;
+    s.PW = PW;
+    s.PH = PH;
+    return s;
+}
+
+// Input gradient. The filter is transposed once to (ci, c, kx, ky), so the
+// schedule vectorizes over the input channels the way the forward one does
+// over the output channels, with dout(c, ...) a scalar broadcast. Each tap
+// reads dout at ox = (ix + P - kx * d) / S, which only exists when S divides
+// the numerator and ox is inside [0, W); the test is marked likely for loop
+// partitioning, and the stride 1 specialization folds the divisibility away.
+class DilatedConvBackwardDataPipeline {
+ public:
+    Var c{"c"}, x{"x"}, y{"y"}, n{"n"};
+    Var co{"co"}, ci{"ci"}, xo{"xo"}, xi{"xi"};
+    Func filter_t{"filter_t"}, din{"din"}, out{"out"};
+    ConvShape shape;
+    RDom r;
+
+    void define(Func dout, Func filter, const ConvShape &shape, Expr DW, Expr DH) {
+        this->shape = shape;
+        r = RDom(0, shape.CO, 0, shape.KW, 0, shape.KH);
+
+        filter_t(c, co, x, y) = filter(co, x, y, c);
+
+        Expr nx = x + shape.PW - r.y * (DW + 1);
+        Expr ny = y + shape.PH - r.z * (DH + 1);
+        Expr ox = nx / shape.SW, oy = ny / shape.SH;
+        Expr inside = nx % shape.SW == 0 && ny % shape.SH == 0 && ox >= 0 && ox < shape.W && oy >= 0 && oy < shape.H;
+        din(c, x, y, n) = 0.0f;
+        din(c, x, y, n) += select(likely(inside),
+                                  filter_t(c, r.x, r.y, r.z) *
+                                      dout(r.x, clamp(ox, 0, shape.W - 1), clamp(oy, 0, shape.H - 1), n),
+                                  0.0f);
+        out(c, x, y, n) = din(c, x, y, n);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = target.natural_vector_size<float>();
+        const int tile_w = 2;
+        const int tile_h = 4;
+
+        // the output tiling of the forward conv, over the input channels
+        specialize_output_tiles(out, vec, tile_w, tile_h, [&](Stage stage, int c_tile, TailStrategy tail) {
+            stage.split(c, co, ci, c_tile, tail)
+                .split(x, xo, xi, tile_h, tail)
+                .reorder(ci, xi, xo, y, n, co)
+                .vectorize(ci, vec)
+                .unroll(ci)
+                .unroll(xi)
+                .parallel(y)
+                .parallel(n)
+                .parallel(co);
+        });
+
+        din.compute_at(out, xo)
+            .vectorize(c, vec)
+            .unroll(c)
+            .unroll(x);
+        din.update()
+            .reorder(c, x, r.x, r.y, r.z, y, n)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .unroll(c)
+            .unroll(x);
+        din.update().specialize(shape.SW == 1 && shape.SH == 1);
+
+        filter_t.compute_root()
+            .parallel(y);
+    }
+};
+
+// Weight gradient. Its reduction over N x W x H is much longer than the
+// output is large, so the output rows are split into bands and rfactor turns
+// the band into a pure dimension: one partial gradient per band, computed in
+// parallel, then summed. Within a band the partial is register blocked: an
+// unrolled tile of output channel vectors by input channels is updated at
+// every step of the reduction, whose loops run outside it.
+class DilatedConvBackwardWeightsPipeline {
+ public:
+    Var c{"c"}, x{"x"}, y{"y"}, k{"k"}, u{"u"};
+    Var co{"co"}, cv{"cv"}, ko{"ko"}, ki{"ki"};
+    RVar ryo{"ryo"}, ryi{"ryi"};
+    Func dfilter{"dfilter"}, partial, out{"out"};
+    ConvShape shape;
+    RDom r;
+
+    // output rows per band
+    static constexpr int band_rows = 8;
+
+    void define(Func input, Func dout, const ConvShape &shape, Expr DW, Expr DH) {
+        this->shape = shape;
+        r = RDom(0, shape.W, 0, shape.H, 0, shape.N);
+
+        // (c, kx, ky, ci), the layout of the filter
+        Func padded = zero_pad(input, shape);
+        dfilter(c, x, y, k) = 0.0f;
+        dfilter(c, x, y, k) += dout(c, r.x, r.y, r.z) *
+                               padded(k, r.x * shape.SW + x * (DW + 1) - shape.PW,
+                                      r.y * shape.SH + y * (DH + 1) - shape.PH, r.z);
+        out(c, x, y, k) = dfilter(c, x, y, k);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = target.natural_vector_size<float>();
+        const int tile_c = 2;
+        const int tile_k = 4;
+
+        dfilter.update().split(r.y, ryo, ryi, band_rows);
+        partial = dfilter.update().rfactor(ryo, u);
+
+        // partial(c, kx, ky, ci, u)
+        partial.compute_root()
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .parallel(u);
+        partial.update()
+            .split(c, co, cv, vec * tile_c, TailStrategy::GuardWithIf)
+            .split(k, ko, ki, tile_k, TailStrategy::GuardWithIf)
+            .reorder(cv, ki, r.x, ryi, r.z, co, ko, x, y, u)
+            .vectorize(cv, vec)
+            .unroll(cv)
+            .unroll(ki)
+            .parallel(y)
+            .parallel(u);
+        partial.update().specialize(is_dense(shape));
+
+        // the sum over the bands, a few adds per weight
+        out.vectorize(c, vec, TailStrategy::GuardWithIf)
+            .parallel(k);
+        dfilter.compute_at(out, k)
+            .vectorize(c, vec, TailStrategy::GuardWithIf);
+    }
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef DILATED_CONV_PIPELINE_H
+#define DILATED_CONV_PIPELINE_H
+
+#include "Halide.h"
+#include "pipeline_common.h"
+
+#include <vector>
+
+using namespace Halide;
+
+// Tunable knobs of the schedule below. The defaults are the hand-written
+// schedule; dilated_conv.cpp --autotune searches over them.
+struct DilatedConvSchedule {
+    int tile_w = 4;          // output channel tile, in vectors
+    int tile_h = 4;          // output x tile
+    int unroll_rx = 2;       // unroll factor of the CI reduction
+    int parallel_depth = 3;  // how many of co, n, y (outermost first) run in parallel
+    int input_at = 1;        // input.in(): 0 inline, 1 at dilated_conv x, 2 at dilated_conv y
+    int filter_at = 0;       // filter.in(): 0 at dilated_conv r.x, 1 at r.y, 2 at r.z
+
+    std::vector<int> params() const {
+        return {tile_w, tile_h, unroll_rx, parallel_depth, input_at, filter_at};
+    }
+
+    // the defaults unless p has one value per knob
+    static DilatedConvSchedule from_params(const std::vector<int> &p) {
+        DilatedConvSchedule s;
+        if (p.size() != s.params().size()) {
+            return s;
+        }
+        s.tile_w = p[0];
+        s.tile_h = p[1];
+        s.unroll_rx = p[2];
+        s.parallel_depth = p[3];
+        s.input_at = p[4];
+        s.filter_at = p[5];
+        return s;
+    }
+};
+
+// Dilated convolution, (c, x, y, n) layout, with stride and zero padding.
+// Shared by the JIT path in dilated_conv.cpp and the AOT generator in
+// generators.cpp.
+class DilatedConvPipeline {
+ public:
+    Var x{"x"}, y{"y"}, c{"c"}, n{"n"};
+    Var co{"co"}, ci{"ci"}, xo{"xo"}, xi{"xi"};
+    Func dilated_conv{"dilated_conv"}, out{"out"};
+    Func input, filter;
+    Expr DW, DH;
+    ConvShape shape;
+    RDom r;
+
+    // define dilated convolution
+    // you can also rewrite algorithm definition part, as long as results are correct
+    // DW and DH are runtime parameters, so one compiled pipeline serves every dilation
+    // an optional per-channel bias seeds the accumulator (see fold_batch_norm)
+    void define(Func input, Func filter, const ConvShape &shape, Expr DW, Expr DH, Func bias = Func()) {
+        this->input = input;
+        this->filter = filter;
+        this->DW = DW;
+        this->DH = DH;
+        this->shape = shape;
+        r = RDom(0, shape.CI, 0, shape.KW, 0, shape.KH);
+
+        if (bias.defined()) {
+            dilated_conv(c, x, y, n) = bias(c);
+        } else {
+            dilated_conv(c, x, y, n) = 0.0f;
+        }
+        Func padded = zero_pad(input, shape);
+        dilated_conv(c, x, y, n) += filter(c, r.y, r.z, r.x) *
+                                    padded(r.x, x * shape.SW + r.y * (DW + 1) - shape.PW,
+                                           y * shape.SH + r.z * (DH + 1) - shape.PH, n);
+        out(c, x, y, n) = dilated_conv(c, x, y, n);
+    }
+
+    void schedule(const Target &target, const DilatedConvSchedule &sched = DilatedConvSchedule()) {
+        // 获取目标设备向量宽度
+        const int vec = target.natural_vector_size<float>();
+
+        // 调整块大小
+        const int tile_w = sched.tile_w;
+        const int tile_h = sched.tile_h;
+
+        // 主函数 out 的调度，按输出形状特化（见 specialize_output_tiles）
+        specialize_output_tiles(out, vec, tile_w, tile_h, [&](Stage stage, int c_tile, TailStrategy tail) {
+            stage.split(c, co, ci, c_tile, tail)
+                .split(x, xo, xi, tile_h, tail)
+                .reorder(ci, xi, xo, y, n, co)
+                .vectorize(ci, vec)        // 按自然向量宽度进行向量化
+                .unroll(ci)               // 对小范围的 `ci` 展开
+                .unroll(xi);              // 展开块内的 x
+            if (sched.parallel_depth >= 3) {
+                stage.parallel(y);        // 对输出的 y 维度并行化
+            }
+            if (sched.parallel_depth >= 2) {
+                stage.parallel(n);        // 对批次并行化
+            }
+            stage.parallel(co);           // 并行处理通道块
+        });
+
+        // 中间计算 dilated_conv 的调度
+        dilated_conv.compute_at(out, xo)
+            .vectorize(c, vec)        // 按 c 向量化
+            .unroll(c)                // 对 c 展开
+            .unroll(x)                // 展开 x 块
+            .unroll(y);               // 展开 y 块
+        dilated_conv.update()
+            .reorder(c, x, y, r.x, r.y, r.z, n)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)  // 归约计算的向量化，通道数不足一个向量时防止越界读
+            .unroll(c)                // 对 c 展开
+            .unroll(x)                // 对 x 展开
+            .unroll(y);               // 对 y 展开
+        if (sched.unroll_rx > 1) {
+            dilated_conv.update().unroll(r.x, sched.unroll_rx);  // 对 r.x 进行展开
+        }
+
+        // 数据预处理的调度
+        const RVar filter_levels[] = {r.x, r.y, r.z};
+        Func filter_in = filter.in();
+        filter_in.compute_at(dilated_conv, filter_levels[sched.filter_at])
+            .vectorize(_0, vec, TailStrategy::GuardWithIf)  // 卷积核向量化
+            .unroll(_0);              // 展开内部维度
+        if (sched.filter_at == 0) {
+            filter_in.unroll(_3);     // 展开通道维度
+        }
+
+        if (sched.input_at == 0) {
+            input.in().compute_inline();
+        } else {
+            input.in().compute_at(dilated_conv, sched.input_at == 1 ? x : y)
+                .unroll(_0);          // 对通道展开
+        }
+
+        // constant-fold the input offsets for the common dilations of stride
+        // 1, unpadded layers, and the stride and padding of any other dense
+        // layer; the specializations inherit the schedule above
+        for (int d : common_dilations) {
+            dilated_conv.update().specialize(is_dense(shape) && DW == d && DH == d);
+        }
+        dilated_conv.update().specialize(is_dense(shape));
+    }
+
+    static constexpr int common_dilations[] = {0, 1};
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef DILATED_CONV_S2B_PIPELINE_H
+#define DILATED_CONV_S2B_PIPELINE_H
+
+#include "Halide.h"
+#include "dilated_conv_pipeline.h"
+#include "pipeline_common.h"
+
+using namespace Halide;
+
+// Dilated convolution by space-to-batch. With D = dilation + 1, the outputs
+// of phase (px, py) = (x % DW1, y % DH1) only read inputs of the same phase,
+// so the input is rearranged into DW1 * DH1 dense sub-images, each one runs a
+// dense conv.cpp-style convolution, and the results are interleaved back.
+// This trades a copy of the input and output for unit-stride taps.
+class DilatedConvS2BPipeline {
+ public:
+    Var x{"x"}, y{"y"}, c{"c"}, n{"n"};
+    Var i{"i"}, j{"j"}, px{"px"}, py{"py"};
+    Var co{"co"}, ci{"ci"}, io{"io"}, ii{"ii"};
+    Func s2b{"s2b"}, conv{"conv"}, dense{"dense"}, out{"out"};
+    Func input, filter;
+    RDom r;
+
+    void define(Func input, Func filter, const ConvShape &shape, Expr DW, Expr DH) {
+        this->input = input;
+        this->filter = filter;
+        Expr DW1 = DW + 1, DH1 = DH + 1;
+        Expr in_w = shape.W + (shape.KW - 1) * DW1;
+        Expr in_h = shape.H + (shape.KH - 1) * DH1;
+        r = RDom(0, shape.CI, 0, shape.KW, 0, shape.KH);
+
+        // sub-image (px, py); phases that end early are clamped to the edge,
+        // the extra outputs they produce are never interleaved back
+        s2b(c, i, j, px, py, n) = input(c, min(i * DW1 + px, in_w - 1), min(j * DH1 + py, in_h - 1), n);
+
+        conv(c, i, j, px, py, n) = 0.0f;
+        conv(c, i, j, px, py, n) += filter(c, r.y, r.z, r.x) * s2b(r.x, i + r.y, j + r.z, px, py, n);
+        dense(c, i, j, px, py, n) = conv(c, i, j, px, py, n);
+
+        out(c, x, y, n) = dense(c, x / DW1, y / DH1, x % DW1, y % DH1, n);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = target.natural_vector_size<float>();
+        const int tile_w = 4;
+        const int tile_h = 4;
+
+        // the rearranged input walks the source rows in order
+        s2b.compute_root()
+            .reorder(c, px, i, py, j, n)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .parallel(n)
+            .parallel(j);
+
+        // the sub-images are internal, so the tails guard rather than shift
+        dense.compute_root()
+            .split(c, co, ci, vec * tile_w, TailStrategy::GuardWithIf)
+            .split(i, io, ii, tile_h, TailStrategy::GuardWithIf)
+            .reorder(ci, ii, io, j, px, py, n, co)
+            .vectorize(ci, vec)
+            .unroll(ci)
+            .unroll(ii)
+            .parallel(j)
+            .parallel(py)
+            .parallel(n)
+            .parallel(co);
+        conv.compute_at(dense, io)
+            .vectorize(c, vec)
+            .unroll(c)
+            .unroll(i)
+            .update()
+            .reorder(c, i, r.x, r.y, r.z, j, px, py, n)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .unroll(c)
+            .unroll(i)
+            .unroll(r.x, 2);
+        filter.in().compute_at(conv, r.x).vectorize(_0, vec, TailStrategy::GuardWithIf).unroll(_0).unroll(_3);
+
+        out.split(c, co, ci, vec, TailStrategy::GuardWithIf)
+            .vectorize(ci)
+            .parallel(y)
+            .parallel(n);
+    }
+};
+
+// Cost model for picking space-to-batch over the direct kernel, in bytes
+// moved from beyond L2 per image:
+//  - every output row of the direct kernel reads KH input rows, DH + 1 rows
+//    apart. An input row comes back for the next vertical tap DH + 1 output
+//    rows later, after (KH - 1) * (DH + 1) + 1 rows have gone by. While those
+//    fit in L2 the input is read once; past that, every tap reads its rows
+//    again, and since the prefetchers stop at page boundaries the start of
+//    each tap misses: once per tap and output tile, or once per tap row when
+//    the horizontal taps share a page. A miss counts as the bytes streamed
+//    in its latency, about 100 ns at 10 GB/s;
+//  - space-to-batch copies the input (a read and a write) and reads it again
+//    in the dense convolution, whose rows fit; the output is written, read
+//    and written again by the interleave.
+// For the default dilated_conv layer (CI = CO = 128, 100 x 80, 3 x 3) this
+// picks the direct kernel up to a dilation of 11 and space-to-batch from 15
+// with a 2 MB L2; with 1 MB, up to 7 and from 9. Once the rows no longer fit
+// the page misses dominate, so the crossover is the L2 test rather than the
+// miss cost.
+inline bool prefer_space_to_batch(int CI, int CO, int W, int H, int KW, int KH, int DW, int DH, int vec,
+                                  long l2_bytes) {
+    const double page_bytes = 4096, miss_bytes = 1024;
+    // the output tile of the direct kernel's default schedule
+    const DilatedConvSchedule sched;
+    const int tile_c = vec * sched.tile_w, tile_x = sched.tile_h;
+    const int DW1 = DW + 1, DH1 = DH + 1;
+    const double row_bytes = (double)(W + (KW - 1) * DW1) * CI * sizeof(float);
+    const double in_bytes = row_bytes * (H + (KH - 1) * DH1);
+    const double out_bytes = (double)W * H * CO * sizeof(float);
+
+    double direct = in_bytes + out_bytes;
+    if (((KH - 1) * DH1 + 1) * row_bytes > l2_bytes) {
+        const bool same_page = DW1 * CI * sizeof(float) < page_bytes;
+        const double tiles = (double)((CO + tile_c - 1) / tile_c) * ((W + tile_x - 1) / tile_x) * H;
+        direct = KH * in_bytes + out_bytes + tiles * KH * (same_page ? 1 : KW) * miss_bytes;
+    }
+    const double s2b = 3 * in_bytes + 3 * out_bytes;
+    return s2b < direct;
+}
+
+#endif
@@ -0,0 +1,225 @@
+#include "Halide.h"
+#include "common.h"
+#include "pool_allocator.h"
+#include "threading.h"
+#include "tensor_file.h"
+#include "dilated_conv_pipeline.h"
+#include "halide_dilated_conv.h"
+
+#include <stdio.h>
+
+using namespace Halide;
+using namespace Halide::Tools;
+
+// The dilated conv on tensors too large for memory. The input, filter and
+// output are memory-mapped tensor files (see tensor_file.h), and the output
+// is computed in bands of rows, one image at a time. Each band runs the
+// dilated_conv kernel on the input rows it reads: its own rows plus the
+// dilation halo of (KH - 1) * (DH + 1) rows below them. While a band
+// computes, the input rows of the next one are read ahead on a thread of
+// their own. Rows no later band needs, and the finished output rows, are
+// dropped from memory, so the resident set stays near the band budget.
+int main(int argc, char **argv) {
+    // --threads, --pin and --numa size and place the Halide and oneDNN thread
+    // pools; this runs before any buffer is allocated (see threading.h)
+    ThreadConfig threading;
+    if (!take_threading(argc, argv, threading)) {
+        return 1;
+    }
+    print_threading(threading);
+    // --alloc system|pool|huge picks the allocator of the Halide intermediates (see pool_allocator.h)
+    if (!take_allocator(argc, argv)) {
+        return 1;
+    }
+    // --shape N,CI,CO,W,H,KW,KH of the layer; --stride and --pad as in
+    // dilated_conv, but the bands need PH = 0
+    ConvConfig shape = {};
+    if (!parse_conv_shape(take_option(argc, argv, "--shape", "2,64,64,2048,2048,3,3"), shape)) {
+        printf("--shape expects N,CI,CO,W,H,KW,KH\n");
+        return 1;
+    }
+    const int N = shape.N, CI = shape.CI, CO = shape.CO, W = shape.W, H = shape.H, KW = shape.KW, KH = shape.KH;
+    const char *stride = take_option(argc, argv, "--stride", "1");
+    const char *pad = take_option(argc, argv, "--pad", "0");
+    // the tensor files; missing input and filter files are created with random data
+    const std::string input_path = take_option(argc, argv, "--input", "dilated_conv_input.tensor");
+    const std::string filter_path = take_option(argc, argv, "--filter", "dilated_conv_filter.tensor");
+    const std::string output_path = take_option(argc, argv, "--output", "dilated_conv_output.tensor");
+    // --budget MB bounds the input and output rows of a band
+    const double budget = atof(take_option(argc, argv, "--budget", "1024")) * 1e6;
+    // --check compares the output file with oneDNN's, which needs every tensor in memory
+    const bool check = take_flag(argc, argv, "--check");
+    const Tolerance tol = take_tolerance(argc, argv);
+    // the AOT kernel from generators.cpp is the default, --jit builds the pipeline at runtime
+    const bool use_jit = take_flag(argc, argv, "--jit");
+    // dilation is a runtime parameter of the compiled pipeline; DH defaults to DW
+    const int DW = (argc > 1) ? atoi(argv[1]) : 63;
+    const int DH = (argc > 2) ? atoi(argv[2]) : DW;
+    shape.DW = DW;
+    shape.DH = DH;
+    if (!parse_stride_padding(stride, pad, shape)) {
+        return 1;
+    }
+    if (shape.PH != 0) {
+        printf("the bands are cut along y, which cannot be padded: use --pad PW,0\n");
+        return 1;
+    }
+    const int IW = shape.input_w(), IH = shape.input_h();
+
+    printf("dilation: %d x %d\n", DW, DH);
+    printf("stride: %d x %d, padding: %d x %d\n", shape.SW, shape.SH, shape.PW, shape.PH);
+
+    // the tensor files, (c, x, y, n) and (co, kx, ky, ci) as in dilated_conv
+    MappedTensor in, fil, out;
+    auto open_or_create = [](MappedTensor &m, const std::string &path, const std::vector<int> &extents) {
+        if (access(path.c_str(), F_OK) == 0) {
+            if (!m.open(path, false)) {
+                return false;
+            }
+            if (!m.has_extents(extents)) {
+                printf("%s: extents do not match --shape and the dilation\n", path.c_str());
+                return false;
+            }
+            return true;
+        }
+        if (!m.create(path, extents)) {
+            return false;
+        }
+        printf("writing %s, %.1f MB of random data\n", path.c_str(), 4.0 * m.elements() / 1e6);
+        random_data(m);
+        return true;
+    };
+    if (!open_or_create(in, input_path, {CI, IW, IH, N}) || !open_or_create(fil, filter_path, {CO, KW, KH, CI})) {
+        return 1;
+    }
+    if (!out.create(output_path, {CO, W, H, N})) {
+        return 1;
+    }
+    Buffer<float, 4> filter_buffer = fil.buffer();
+
+    // rows per band: the most output rows whose input rows (with the halo)
+    // and output rows fit the budget
+    const int halo = (KH - 1) * (DH + 1);
+    const int64_t in_row = (int64_t)CI * IW, out_row = (int64_t)CO * W;
+    auto band_input_rows = [&](int rows) { return std::min(IH, (rows - 1) * shape.SH + halo + 1); };
+    int band = 1;
+    while (band < H && 4.0 * (band_input_rows(band + 1) * in_row + (band + 1) * out_row) <= budget) {
+        band++;
+    }
+    printf("bands: %d output rows, reading %d input rows (%d of halo), %.1f MB\n", band, band_input_rows(band),
+           halo, 4.0 * (band_input_rows(band) * in_row + band * out_row) / 1e6);
+    if (4.0 * (band_input_rows(band) * in_row + band * out_row) > budget) {
+        printf("a single output row needs more than --budget\n");
+    }
+
+    // the bands of every image, with their first output and input rows
+    struct Band {
+        int n, y, rows, in_y, in_rows;
+    };
+    std::vector<Band> bands;
+    for (int n = 0; n < N; n++) {
+        for (int y = 0; y < H; y += band) {
+            const int rows = std::min(band, H - y);
+            const int in_y = y * shape.SH;
+            bands.push_back({n, y, rows, in_y, std::min(IH - in_y, band_input_rows(rows))});
+        }
+    }
+    auto input_range = [&](const Band &b) {
+        int64_t begin = ((int64_t)b.n * IH + b.in_y) * in_row;
+        return std::make_pair(begin, begin + b.in_rows * in_row);
+    };
+    auto output_range = [&](const Band &b) {
+        int64_t begin = ((int64_t)b.n * H + b.y) * out_row;
+        return std::make_pair(begin, begin + b.rows * out_row);
+    };
+
+    ImageParam input(type_of<float>(), 4), filter(type_of<float>(), 4);
+    Param<int> dw("DW"), dh("DH"), sw("SW"), sh("SH"), pw("PW"), ph("PH");
+    DilatedConvPipeline p;
+    Target target = get_jit_target_from_environment();
+    if (use_jit) {
+        p.define(input, filter, conv_shape(input, filter, dw, dh, sw, sh, pw, ph), dw, dh);
+        p.schedule(target);
+        filter.set(filter_buffer);
+        dw.set(DW);
+        dh.set(DH);
+        sw.set(shape.SW);
+        sh.set(shape.SH);
+        pw.set(shape.PW);
+        ph.set(shape.PH);
+        use_allocator(p.out);
+        p.out.compile_jit(target);
+    }
+    // one band: views of its rows in the mapped files, as buffers starting at 0
+    auto run_band = [&](const Band &b) {
+        Buffer<float, 4> in_band(in.data() + input_range(b).first, CI, IW, b.in_rows, 1);
+        Buffer<float, 4> out_band(out.data() + output_range(b).first, CO, W, b.rows, 1);
+        if (use_jit) {
+            input.set(in_band);
+            p.out.realize(out_band);
+        } else {
+            halide_dilated_conv(in_band.raw_buffer(), filter_buffer.raw_buffer(), DW, DH, shape.SW, shape.SH,
+                                shape.PW, shape.PH, out_band.raw_buffer());
+        }
+    };
+
+    // the input is read front to back, with the next band read ahead
+    in.advise(0, in.elements(), MADV_SEQUENTIAL);
+    in.prefetch(input_range(bands[0]).first, input_range(bands[0]).second);
+    double t_compute = 0, t_wait = 0;
+    auto start = benchmark_now();
+    for (size_t i = 0; i < bands.size(); i++) {
+        const Band &b = bands[i];
+        std::thread reader;
+        if (i + 1 < bands.size()) {
+            auto next = input_range(bands[i + 1]);
+            in.prefetch(next.first, next.second);
+            reader = std::thread([&, next]() { in.fault_in(next.first, next.second); });
+        }
+        auto t0 = benchmark_now();
+        run_band(b);
+        auto t1 = benchmark_now();
+        if (reader.joinable()) {
+            reader.join();
+        }
+        t_compute += benchmark_duration_seconds(t0, t1);
+        t_wait += benchmark_duration_seconds(t1, benchmark_now());
+
+        // drop the input rows the next band starts after, and the output rows
+        auto done = input_range(b);
+        if (i + 1 < bands.size()) {
+            done.second = std::min(done.second, input_range(bands[i + 1]).first);
+        }
+        in.release(done.first, done.second);
+        out.release(output_range(b).first, output_range(b).second);
+    }
+    double t_total = benchmark_duration_seconds(start, benchmark_now());
+
+    double flops = 2.0 * N * CO * H * W * (double)CI * KH * KW;
+    double in_bytes = 4.0 * in.elements(), out_bytes = 4.0 * out.elements();
+    printf("Halide (%s): %fms, %f GFLOP/s\n", use_jit ? "JIT" : "AOT", t_total * 1e3, flops / 1e9 / t_total);
+    printf("compute: %fms in %zu bands, waiting for reads: %fms\n", t_compute * 1e3, bands.size(), t_wait * 1e3);
+    printf("streamed: %.1f MB in, %.1f MB out, %f GB/s\n", in_bytes / 1e6, out_bytes / 1e6,
+           (in_bytes + out_bytes) / 1e9 / t_total);
+
+    if (check) {
+        Buffer<float, 4> in_buffer = in.buffer(), out_buffer = out.buffer();
+        Buffer<float, 4> output_ref(CO, W, H, N);
+        dnnl_dilated_conv_wrapper(in_buffer.data(), filter_buffer.data(), output_ref.data(), shape,
+                                  [](const std::function<void()> &op) {
+                                      op();
+                                      return 0.0;
+                                  });
+        if (check_equal<float, 4>(output_ref, out_buffer, tol)) {
+            printf("Halide results - OK\n");
+        } else {
+            printf("Halide results - FAIL\n");
+            return 1;
+        }
+    }
+    printf("\n");
+
+    printf("Success!\n");
+
+    return 0;
+}
@@ -0,0 +1,463 @@
+#include "Halide.h"
+
+#include "blocked_conv_pipeline.h"
+#include "conv_pipeline.h"
+#include "dilated_conv_backward_pipeline.h"
+#include "dilated_conv_pipeline.h"
+#include "dilated_conv_s2b_pipeline.h"
+#include "grouped_conv_pipeline.h"
+#include "im2col_conv_pipeline.h"
+#include "layer_stack_pipeline.h"
+#include "matmul_pipeline.h"
+#include "op_fuse_pipeline.h"
+#include "winograd_pipeline.h"
+
+// AOT generators for the kernels in this directory. Linked against GenGen.cpp
+// and invoked from the Makefile to emit a static library and header per
+// kernel, so the drivers do not pay an LLVM JIT compile on startup. The conv
+// kernels read every layer dimension from their buffers at runtime.
+
+class MatmulGenerator : public Halide::Generator<MatmulGenerator> {
+ public:
+    GeneratorParam<int> matrix_size{"matrix_size", 992};
+
+    Input<Buffer<float>> A{"A", 2};
+    Input<Buffer<float>> B{"B", 2};
+    Output<Buffer<float>> output{"output", 2};
+
+    void generate() {
+        p.define(A, B, matrix_size);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule();
+    }
+
+ private:
+    MatmulPipeline p;
+};
+
+// General, batched SGEMM (see GemmPipeline), one kernel per layout of A and B.
+class GemmGenerator : public Halide::Generator<GemmGenerator> {
+ public:
+    GeneratorParam<bool> transpose_a{"transpose_a", false};
+    GeneratorParam<bool> transpose_b{"transpose_b", false};
+
+    Input<Buffer<float>> A{"A", 3};
+    Input<Buffer<float>> B{"B", 3};
+    Input<Buffer<float>> C{"C", 3};
+    Input<float> alpha{"alpha", 1.0f};
+    Input<float> beta{"beta", 0.0f};
+    Output<Buffer<float>> output{"output", 3};
+
+    void generate() {
+        Expr K = transpose_a ? A.dim(1).extent() : A.dim(0).extent();
+        p.define(A, B, C, K, alpha, beta, transpose_a, transpose_b);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule();
+    }
+
+ private:
+    GemmPipeline p;
+};
+
+// The cache-blocked GEMM (see BlockedGemmPipeline); kc, mc and nc come from
+// BlockedGemmPipeline::blocking() at runtime.
+class GemmBlockedGenerator : public Halide::Generator<GemmBlockedGenerator> {
+ public:
+    GeneratorParam<bool> transpose_a{"transpose_a", false};
+    GeneratorParam<bool> transpose_b{"transpose_b", false};
+
+    Input<Buffer<float>> A{"A", 3};
+    Input<Buffer<float>> B{"B", 3};
+    Input<Buffer<float>> C{"C", 3};
+    Input<float> alpha{"alpha", 1.0f};
+    Input<float> beta{"beta", 0.0f};
+    Input<int> kc{"kc", 256};
+    Input<int> mc{"mc", 64};
+    Input<int> nc{"nc", 256};
+    Output<Buffer<float>> output{"output", 3};
+
+    void generate() {
+        Expr M = transpose_a ? A.dim(0).extent() : A.dim(1).extent();
+        Expr N = transpose_b ? B.dim(1).extent() : B.dim(0).extent();
+        Expr K = transpose_a ? A.dim(1).extent() : A.dim(0).extent();
+        p.define(A, B, C, M, N, K, alpha, beta, transpose_a, transpose_b, kc, mc, nc);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule();
+    }
+
+ private:
+    BlockedGemmPipeline p;
+};
+
+class ConvGenerator : public Halide::Generator<ConvGenerator> {
+ public:
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> filter{"filter", 4};
+    Input<int> SW{"SW", 1};
+    Input<int> SH{"SH", 1};
+    Input<int> PW{"PW", 0};
+    Input<int> PH{"PH", 0};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        p.define(input, filter, conv_shape(input, filter, 0, 0, SW, SH, PW, PH));
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    ConvPipeline p;
+};
+
+class DilatedConvGenerator : public Halide::Generator<DilatedConvGenerator> {
+ public:
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> filter{"filter", 4};
+    Input<int> DW{"DW", 31};
+    Input<int> DH{"DH", 31};
+    Input<int> SW{"SW", 1};
+    Input<int> SH{"SH", 1};
+    Input<int> PW{"PW", 0};
+    Input<int> PH{"PH", 0};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        p.define(input, filter, conv_shape(input, filter, DW, DH, SW, SH, PW, PH), DW, DH);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    DilatedConvPipeline p;
+};
+
+// Dilated conv with a per-channel bias: an inference-mode batchnorm folded
+// into the filter and bias runs through this at the cost of a plain conv.
+class DilatedConvBiasGenerator : public Halide::Generator<DilatedConvBiasGenerator> {
+ public:
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> filter{"filter", 4};
+    Input<Buffer<float>> bias{"bias", 1};
+    Input<int> DW{"DW", 31};
+    Input<int> DH{"DH", 31};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        p.define(input, filter, conv_shape(input, filter, DW, DH), DW, DH, bias);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    DilatedConvPipeline p;
+};
+
+class DilatedConvS2BGenerator : public Halide::Generator<DilatedConvS2BGenerator> {
+ public:
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> filter{"filter", 4};
+    Input<int> DW{"DW", 31};
+    Input<int> DH{"DH", 31};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        p.define(input, filter, conv_shape(input, filter, DW, DH), DW, DH);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    DilatedConvS2BPipeline p;
+};
+
+// Grouped dilated conv. The output is the (c, x, y, n) tensor viewed as
+// (c % group size, group, x, y, n), see grouped_view in common.h.
+class GroupedConvGenerator : public Halide::Generator<GroupedConvGenerator> {
+ public:
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> filter{"filter", 4};
+    Input<int> groups{"groups", 1};
+    Input<int> DW{"DW", 0};
+    Input<int> DH{"DH", 0};
+    Input<int> SW{"SW", 1};
+    Input<int> SH{"SH", 1};
+    Input<int> PW{"PW", 0};
+    Input<int> PH{"PH", 0};
+    Output<Buffer<float>> output{"output", 5};
+
+    void generate() {
+        p.define(input, filter, conv_shape(input, filter, DW, DH, SW, SH, PW, PH), DW, DH, groups);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    GroupedConvPipeline p;
+};
+
+class DepthwiseConvGenerator : public Halide::Generator<DepthwiseConvGenerator> {
+ public:
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> filter{"filter", 4};
+    Input<int> DW{"DW", 0};
+    Input<int> DH{"DH", 0};
+    Input<int> SW{"SW", 1};
+    Input<int> SH{"SH", 1};
+    Input<int> PW{"PW", 0};
+    Input<int> PH{"PH", 0};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        p.define(input, filter, conv_shape(input, filter, DW, DH, SW, SH, PW, PH), DW, DH);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    DepthwiseConvPipeline p;
+};
+
+// The dilated conv on nChw<block>c activations and OIhw<block>i<block>o
+// weights, one kernel per channel block.
+class BlockedConvGenerator : public Halide::Generator<BlockedConvGenerator> {
+ public:
+    GeneratorParam<int> block{"block", 8};
+
+    Input<Buffer<float>> input{"input", 5};
+    Input<Buffer<float>> filter{"filter", 6};
+    Input<int> DW{"DW", 31};
+    Input<int> DH{"DH", 31};
+    Input<int> SW{"SW", 1};
+    Input<int> SH{"SH", 1};
+    Input<int> PW{"PW", 0};
+    Input<int> PH{"PH", 0};
+    Output<Buffer<float>> output{"output", 5};
+
+    void generate() {
+        p.define(input, filter, blocked_conv_shape(input, filter, DW, DH, SW, SH, PW, PH), block, DW, DH);
+        output = p.out;
+    }
+
+    void schedule() {
+        input.dim(0).set_bounds(0, block);
+        filter.dim(0).set_bounds(0, block);
+        filter.dim(1).set_bounds(0, block);
+        p.schedule(get_target());
+    }
+
+ private:
+    BlockedConvPipeline p;
+};
+
+// The backward pass of dilated_conv: the input gradient from the output
+// gradient and the filter, and the filter gradient from the input and the
+// output gradient.
+class DilatedConvBackwardDataGenerator : public Halide::Generator<DilatedConvBackwardDataGenerator> {
+ public:
+    Input<Buffer<float>> output_grad{"output_grad", 4};
+    Input<Buffer<float>> filter{"filter", 4};
+    Input<int> DW{"DW", 31};
+    Input<int> DH{"DH", 31};
+    Input<int> SW{"SW", 1};
+    Input<int> SH{"SH", 1};
+    Input<int> PW{"PW", 0};
+    Input<int> PH{"PH", 0};
+    Output<Buffer<float>> input_grad{"input_grad", 4};
+
+    void generate() {
+        p.define(output_grad, filter, backward_data_shape(output_grad, filter, SW, SH, PW, PH), DW, DH);
+        input_grad = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    DilatedConvBackwardDataPipeline p;
+};
+
+class DilatedConvBackwardWeightsGenerator : public Halide::Generator<DilatedConvBackwardWeightsGenerator> {
+ public:
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> output_grad{"output_grad", 4};
+    Input<int> DW{"DW", 31};
+    Input<int> DH{"DH", 31};
+    Input<int> SW{"SW", 1};
+    Input<int> SH{"SH", 1};
+    Input<int> PW{"PW", 0};
+    Input<int> PH{"PH", 0};
+    Output<Buffer<float>> filter_grad{"filter_grad", 4};
+
+    void generate() {
+        p.define(input, output_grad, backward_weights_shape(input, output_grad, SW, SH, PW, PH), DW, DH);
+        filter_grad = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    DilatedConvBackwardWeightsPipeline p;
+};
+
+class Im2colConvGenerator : public Halide::Generator<Im2colConvGenerator> {
+ public:
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> filter{"filter", 4};
+    Input<int> DW{"DW", 0};
+    Input<int> DH{"DH", 0};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        p.define(input, filter, conv_shape(input, filter, DW, DH), DW, DH);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    Im2colConvPipeline p;
+};
+
+class OpFuseGenerator : public Halide::Generator<OpFuseGenerator> {
+ public:
+    GeneratorParam<float> epsilon{"epsilon", 1.e-9f};
+
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> filter{"filter", 4};
+    Input<int> DW{"DW", 31};
+    Input<int> DH{"DH", 31};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        p.define(input, filter, conv_shape(input, filter, DW, DH), DW, DH, epsilon);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    OpFusePipeline p;
+};
+
+// conv -> BN -> ReLU layers fused across layers. The number of layers is the
+// size of the filter, bias and dilation arrays, set on the generator command
+// line (see the Makefile).
+class LayerStackGenerator : public Halide::Generator<LayerStackGenerator> {
+ public:
+    GeneratorParam<bool> fused{"fused", true};
+
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>[]> filters{"filters", 4};
+    Input<Buffer<float>[]> biases{"biases", 1};
+    Input<int[]> dilations{"dilations"};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        std::vector<StackLayer> layers;
+        for (size_t i = 0; i < filters.size(); i++) {
+            layers.push_back(stack_layer(filters[i], biases[i], dilations[i]));
+        }
+        p.define(input, layers);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target(), fused);
+    }
+
+ private:
+    LayerStackPipeline p;
+};
+
+class WinogradFilterGenerator : public Halide::Generator<WinogradFilterGenerator> {
+ public:
+    GeneratorParam<int> m{"m", 2};
+
+    Input<Buffer<float>> filter{"filter", 4};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        p.define(filter, m);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    WinogradFilterPipeline p;
+};
+
+class WinogradConvGenerator : public Halide::Generator<WinogradConvGenerator> {
+ public:
+    GeneratorParam<int> m{"m", 2};
+
+    Input<Buffer<float>> input{"input", 4};
+    Input<Buffer<float>> U{"U", 4};
+    Output<Buffer<float>> output{"output", 4};
+
+    void generate() {
+        p.define(input, U, winograd_shape(input, U), m);
+        output = p.out;
+    }
+
+    void schedule() {
+        p.schedule(get_target());
+    }
+
+ private:
+    WinogradConvPipeline p;
+};
+
+HALIDE_REGISTER_GENERATOR(MatmulGenerator, matmul)
+HALIDE_REGISTER_GENERATOR(GemmGenerator, gemm)
+HALIDE_REGISTER_GENERATOR(GemmBlockedGenerator, gemm_blocked)
+HALIDE_REGISTER_GENERATOR(ConvGenerator, conv)
+HALIDE_REGISTER_GENERATOR(DilatedConvGenerator, dilated_conv)
+HALIDE_REGISTER_GENERATOR(DilatedConvBiasGenerator, dilated_conv_bias)
+HALIDE_REGISTER_GENERATOR(DilatedConvS2BGenerator, dilated_conv_s2b)
+HALIDE_REGISTER_GENERATOR(GroupedConvGenerator, grouped_conv)
+HALIDE_REGISTER_GENERATOR(DepthwiseConvGenerator, depthwise_conv)
+HALIDE_REGISTER_GENERATOR(BlockedConvGenerator, blocked_conv)
+HALIDE_REGISTER_GENERATOR(DilatedConvBackwardDataGenerator, dilated_conv_backward_data)
+HALIDE_REGISTER_GENERATOR(DilatedConvBackwardWeightsGenerator, dilated_conv_backward_weights)
+HALIDE_REGISTER_GENERATOR(Im2colConvGenerator, im2col_conv)
+HALIDE_REGISTER_GENERATOR(OpFuseGenerator, op_fuse)
+HALIDE_REGISTER_GENERATOR(LayerStackGenerator, layer_stack)
+HALIDE_REGISTER_GENERATOR(WinogradFilterGenerator, winograd_filter)
+HALIDE_REGISTER_GENERATOR(WinogradConvGenerator, winograd_conv)
@@ -0,0 +1,134 @@
+#ifndef GROUPED_CONV_PIPELINE_H
+#define GROUPED_CONV_PIPELINE_H
+
+#include "Halide.h"
+#include "pipeline_common.h"
+
+using namespace Halide;
+
+// Grouped dilated convolution with stride and zero padding. The CI input and
+// CO output channels are split into `groups` groups, and output channel group
+// g only reads input channel group g: the filter is (co, kw, kh, ci) with
+// CI / groups input channels.
+//
+// The output is the (c, x, y, n) tensor viewed as (cg, g, x, y, n), cg being
+// the channel within its group (see grouped_view in common.h), so the
+// schedule vectorizes over the output channels of one group and the input
+// channel g * CI / groups + r.x stays a scalar broadcast, without a division
+// per lane.
+class GroupedConvPipeline {
+ public:
+    Var cg{"cg"}, g{"g"}, x{"x"}, y{"y"}, n{"n"};
+    Var co{"co"}, ci{"ci"}, xo{"xo"}, xi{"xi"};
+    Func grouped{"grouped"}, out{"out"};
+    Func input, filter;
+    ConvShape shape;
+    RDom r;
+
+    void define(Func input, Func filter, const ConvShape &shape, Expr DW, Expr DH, Expr groups) {
+        this->input = input;
+        this->filter = filter;
+        this->shape = shape;
+        Expr group_ci = shape.CI / groups, group_co = shape.CO / groups;
+        r = RDom(0, group_ci, 0, shape.KW, 0, shape.KH);
+
+        Func padded = zero_pad(input, shape);
+        grouped(cg, g, x, y, n) = 0.0f;
+        grouped(cg, g, x, y, n) += filter(g * group_co + cg, r.y, r.z, r.x) *
+                                   padded(g * group_ci + r.x, x * shape.SW + r.y * (DW + 1) - shape.PW,
+                                          y * shape.SH + r.z * (DH + 1) - shape.PH, n);
+        out(cg, g, x, y, n) = grouped(cg, g, x, y, n);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = target.natural_vector_size<float>();
+        const int tile_w = 2;
+        const int tile_h = 4;
+
+        // the same tiling as the dense dilated conv, over the channels of a group
+        specialize_output_tiles(out, vec, tile_w, tile_h, [&](Stage stage, int c_tile, TailStrategy tail) {
+            stage.split(cg, co, ci, c_tile, tail)
+                .split(x, xo, xi, tile_h, tail)
+                .reorder(ci, xi, xo, co, y, g, n)
+                .vectorize(ci, vec)
+                .unroll(ci)
+                .unroll(xi)
+                .parallel(y)
+                .parallel(g)
+                .parallel(n);
+        }, 2);
+
+        grouped.compute_at(out, xo)
+            .vectorize(cg, vec)
+            .unroll(cg)
+            .unroll(x);
+        grouped.update()
+            .reorder(cg, x, r.x, r.y, r.z, y, g, n)
+            .vectorize(cg, vec, TailStrategy::GuardWithIf)
+            .unroll(cg)
+            .unroll(x);
+        grouped.update().specialize(is_dense(shape));
+    }
+};
+
+// Depthwise dilated convolution: one group per channel, CI = CO = groups, and
+// a (c, kw, kh, 1) filter. There is no channel reduction at all, so each
+// output is KW * KH multiply-adds on data that is read once: the kernel is
+// bound by memory bandwidth. The schedule vectorizes over the channels, which
+// are contiguous in both the input and the output, and keeps a tile of
+// outputs in registers while it walks the taps.
+class DepthwiseConvPipeline {
+ public:
+    Var c{"c"}, x{"x"}, y{"y"}, n{"n"};
+    Var co{"co"}, ci{"ci"}, xo{"xo"}, xi{"xi"};
+    Func depthwise{"depthwise"}, out{"out"};
+    Func input, filter;
+    ConvShape shape;
+    RDom r;
+
+    void define(Func input, Func filter, const ConvShape &shape, Expr DW, Expr DH) {
+        this->input = input;
+        this->filter = filter;
+        this->shape = shape;
+        r = RDom(0, shape.KW, 0, shape.KH);
+
+        Func padded = zero_pad(input, shape);
+        depthwise(c, x, y, n) = 0.0f;
+        depthwise(c, x, y, n) += filter(c, r.x, r.y, 0) *
+                                 padded(c, x * shape.SW + r.x * (DW + 1) - shape.PW,
+                                        y * shape.SH + r.y * (DH + 1) - shape.PH, n);
+        out(c, x, y, n) = depthwise(c, x, y, n);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = target.natural_vector_size<float>();
+        const int tile_w = 2;
+        const int tile_h = 4;
+
+        // channel blocks innermost, so consecutive tiles stream through
+        // consecutive input rows
+        specialize_output_tiles(out, vec, tile_w, tile_h, [&](Stage stage, int c_tile, TailStrategy tail) {
+            stage.split(c, co, ci, c_tile, tail)
+                .split(x, xo, xi, tile_h, tail)
+                .reorder(ci, xi, co, xo, y, n)
+                .vectorize(ci, vec)
+                .unroll(ci)
+                .unroll(xi)
+                .parallel(y)
+                .parallel(n);
+        });
+
+        depthwise.compute_at(out, co)
+            .vectorize(c, vec)
+            .unroll(c)
+            .unroll(x);
+        depthwise.update()
+            .reorder(c, x, r.x, r.y, y, n)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .unroll(c)
+            .unroll(x);
+        depthwise.update().specialize(is_dense(shape));
+    }
+};
+
+#endif
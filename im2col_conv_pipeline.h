@@ -0,0 +1,70 @@
+#ifndef IM2COL_CONV_PIPELINE_H
+#define IM2COL_CONV_PIPELINE_H
+
+#include "Halide.h"
+#include "matmul_pipeline.h"
+#include "pipeline_common.h"
+
+using namespace Halide;
+
+// Dense or dilated convolution lowered to a GEMM: each output pixel is a row
+// of K = CI * KW * KH gathered inputs (im2col), multiplied by the K x CO
+// filter. The im2col panel of one row tile is materialized once and reused
+// for every channel tile, and the GEMM itself runs the blocked schedule of
+// matmul.cpp, with output channels as GEMM columns and pixels as rows.
+class Im2colConvPipeline {
+ public:
+    Var x{"x"}, y{"y"}, c{"c"}, n{"n"}, k{"k"}, kw{"kw"}, kh{"kh"};
+    Var co{"co"}, ci{"ci"}, xo{"xo"}, xi{"xi"}, xii{"xii"};
+    Func im2col{"im2col"}, gemm{"gemm"}, out{"out"};
+    Func input, filter;
+    RDom r;
+
+    void define(Func input, Func filter, const ConvShape &shape, Expr DW, Expr DH) {
+        this->input = input;
+        this->filter = filter;
+        r = RDom(0, shape.CI, 0, shape.KW, 0, shape.KH);
+
+        im2col(k, kw, kh, x, y, n) = input(k, x + kw * (DW + 1), y + kh * (DH + 1), n);
+
+        gemm(c, x, y, n) += filter(c, r.y, r.z, r.x) * im2col(r.x, r.y, r.z, x, y, n);
+
+        out(c, x, y, n) = gemm(c, x, y, n);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = MatmulPipeline::vec;
+        const int strip = MatmulPipeline::strip;
+        const int tile_w = MatmulPipeline::tile_x / vec;
+        const int tile_h = MatmulPipeline::tile_y;
+
+        // GEMM tiles over (c, x); the channel tiles run inside a row tile so
+        // they share its im2col panel
+        specialize_output_tiles(out, vec, tile_w, tile_h, [&](Stage stage, int c_tile, TailStrategy tail) {
+            stage.split(c, co, ci, c_tile, tail)
+                .split(x, xo, xi, tile_h, tail)
+                .split(xi, xi, xii, strip, TailStrategy::GuardWithIf)
+                .reorder(ci, xii, xi, co, xo, y, n)
+                .vectorize(ci, vec)
+                .unroll(ci)
+                .unroll(xii)
+                .parallel(y)
+                .parallel(n);
+        });
+
+        gemm.compute_at(out, xi).vectorize(c, vec).unroll(c).unroll(x);
+
+        gemm.update(0)
+            .reorder(c, x, r.x, r.y, r.z, y, n)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .unroll(c)
+            .unroll(x)
+            .unroll(r.x, MatmulPipeline::unroll_k);
+
+        // explicit im2col: one contiguous K x tile_h panel per row tile
+        im2col.compute_at(out, xo)
+            .vectorize(k, vec, TailStrategy::GuardWithIf);
+    }
+};
+
+#endif
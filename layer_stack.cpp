@@ -0,0 +1,219 @@
+#include "Halide.h"
+#include "common.h"
+#include "perf_counters.h"
+#include "pool_allocator.h"
+#include "threading.h"
+#include "layer_stack_pipeline.h"
+#include "halide_layer_stack.h"
+#include "halide_layer_stack_unfused.h"
+
+#include <stdio.h>
+
+using namespace Halide;
+using namespace Halide::Tools;
+
+// A stack of dilated conv -> BN -> ReLU layers, the batchnorms in inference
+// mode and folded into the convs. Halide runs the whole stack as one pipeline
+// with the intermediates kept per output tile; oneDNN runs the equivalent
+// sequence of conv and batchnorm + ReLU primitives.
+int main(int argc, char **argv) {
+    // --threads, --pin and --numa size and place the Halide and oneDNN thread
+    // pools; this runs before any buffer is allocated (see threading.h)
+    ThreadConfig threading;
+    if (!take_threading(argc, argv, threading)) {
+        return 1;
+    }
+    print_threading(threading);
+    // --alloc system|pool|huge picks the allocator of the Halide intermediates (see pool_allocator.h)
+    if (!take_allocator(argc, argv)) {
+        return 1;
+    }
+    // --shape N,CI,CO,W,H,KW,KH: the first layer maps CI to CO channels, the
+    // others CO to CO; W and H are the extents of the last layer's output
+    ConvConfig shape = {};
+    if (!parse_conv_shape(take_option(argc, argv, "--shape", "5,128,128,100,80,3,3"), shape)) {
+        printf("--shape expects N,CI,CO,W,H,KW,KH\n");
+        return 1;
+    }
+    const int N = shape.N, CI = shape.CI, CO = shape.CO, KW = shape.KW, KH = shape.KH;
+    // --counters also reports hardware counters (perf_event_open) of both runs
+    const bool counters = take_flag(argc, argv, "--counters");
+    // --atol, --rtol and --ulp set the tolerances of the result check; the
+    // error grows with the depth of the stack, so a relative bound by default
+    Tolerance def_tol;
+    def_tol.rel = 1e-4f;
+    const Tolerance tol = take_tolerance(argc, argv, def_tol);
+    // the AOT kernel from generators.cpp is the default, --jit builds the pipeline at runtime
+    const bool use_jit = take_flag(argc, argv, "--jit");
+    // --unfused computes every layer in full before the next, for comparison
+    const bool fused = !take_flag(argc, argv, "--unfused");
+    // one dilation per layer, 1 2 by default; the AOT kernel has two layers
+    std::vector<int> dilations;
+    for (int i = 1; i < argc; i++) {
+        dilations.push_back(atoi(argv[i]));
+    }
+    if (dilations.empty()) {
+        dilations = {1, 2};
+    }
+    const int L = dilations.size();
+    if (!use_jit && L != 2) {
+        printf("the AOT stack has 2 layers, use --jit for %d\n", L);
+        return 1;
+    }
+    const float epsilon = 1.e-9f;
+
+    // layer shapes, from the last output back to the input
+    std::vector<ConvConfig> layers(L);
+    for (int i = L - 1; i >= 0; i--) {
+        layers[i] = {N, i == 0 ? CI : CO, CO, shape.W, shape.H, KW, KH, dilations[i], dilations[i]};
+        if (i < L - 1) {
+            layers[i].W = layers[i + 1].input_w();
+            layers[i].H = layers[i + 1].input_h();
+        }
+    }
+
+    printf("layers: %d, dilations:", L);
+    for (int d : dilations) {
+        printf(" %d", d);
+    }
+    printf("\nschedule: %s\n", fused ? "fused (overlapping tiles)" : "layer by layer");
+
+    Buffer<float, 4> in(CI, layers[0].input_w(), layers[0].input_h(), N);
+    random_data<float, 4>(in);
+
+    // per layer: the filter and batchnorm parameters, folded at load time, and
+    // the oneDNN output; running statistics of the same order as those of the
+    // random conv output, as in op_fuse
+    std::vector<Buffer<float, 4>> fil, fil_folded, output_ref;
+    std::vector<Buffer<float, 1>> mean, variance, scale, shift, bias_folded;
+    for (const ConvConfig &l : layers) {
+        fil.emplace_back(l.CO, l.KW, l.KH, l.CI);
+        fil_folded.emplace_back(l.CO, l.KW, l.KH, l.CI);
+        output_ref.emplace_back(l.CO, l.W, l.H, l.N);
+        random_data<float, 4>(fil.back());
+        const float taps = l.CI * l.KW * l.KH;
+        for (auto *b : {&mean, &variance, &scale, &shift, &bias_folded}) {
+            b->emplace_back(l.CO);
+            random_data<float, 1>(b->back());
+        }
+        mean.back().for_each_value([&](float &m) { m = taps * (0.2f + 0.1f * m); });
+        variance.back().for_each_value([&](float &v) { v = taps * (0.04f + 0.04f * v); });
+        fold_batch_norm(fil.back(), mean.back(), variance.back(), scale.back(), shift.back(), epsilon,
+                        fil_folded.back(), bias_folded.back());
+    }
+    Buffer<float, 4> output_halide(CO, shape.W, shape.H, N);
+
+    ImageParam input(type_of<float>(), 4);
+    std::vector<ImageParam> filters, biases;
+    std::vector<Param<int>> dilation_params;
+    LayerStackPipeline p;
+
+    // cold start: pipeline construction, compilation (JIT only) and the first call
+    auto cold_start = benchmark_now();
+    std::function<void()> run;
+    if (use_jit) {
+        Target target = get_jit_target_from_environment();
+        std::vector<StackLayer> stack;
+        for (int i = 0; i < L; i++) {
+            filters.emplace_back(type_of<float>(), 4);
+            biases.emplace_back(type_of<float>(), 1);
+            dilation_params.emplace_back();
+        }
+        for (int i = 0; i < L; i++) {
+            stack.push_back(stack_layer(filters[i], biases[i], dilation_params[i]));
+            filters[i].set(fil_folded[i]);
+            biases[i].set(bias_folded[i]);
+            dilation_params[i].set(dilations[i]);
+        }
+        p.define(input, stack);
+        p.schedule(target, fused);
+        input.set(in);
+        use_allocator(p.out);
+        p.out.compile_jit(target);
+        run = [&]() { p.out.realize(output_halide); };
+    } else {
+        auto kernel = fused ? halide_layer_stack : halide_layer_stack_unfused;
+        run = [&, kernel]() {
+            kernel(in.raw_buffer(), fil_folded[0].raw_buffer(), fil_folded[1].raw_buffer(),
+                   bias_folded[0].raw_buffer(), bias_folded[1].raw_buffer(), dilations[0], dilations[1],
+                   output_halide.raw_buffer());
+        };
+    }
+    run();
+    double t_cold = benchmark_duration_seconds(cold_start, benchmark_now());
+
+    double t_halide = benchmark(10, 10, run);
+    // allocations of one call, once the pools are warm
+    AllocStats alloc_before = alloc_stats();
+    run();
+    AllocStats halide_allocs = alloc_stats() - alloc_before;
+    // the oneDNN wrappers time through this, which also collects its counters
+    PerfSample halide_counters, onednn_counters;
+    auto onednn_timer = [&](const std::function<void()> &op) {
+        double t = fixed_benchmark(op);
+        if (counters) {
+            onednn_counters += measure_counters(op);
+        }
+        return t;
+    };
+    if (counters) {
+        halide_counters = measure_counters(run);
+    }
+
+    // oneDNN: a conv and a batchnorm + ReLU primitive per layer, each layer
+    // reading the previous one's output from memory
+    double t_onednn = 0;
+    for (int i = 0; i < L; i++) {
+        const ConvConfig &l = layers[i];
+        float *src = i == 0 ? in.data() : output_ref[i - 1].data();
+        t_onednn += dnnl_dilated_conv_wrapper(src, fil[i].data(), output_ref[i].data(), l, onednn_timer);
+        t_onednn += dnnl_batch_normalization_inference_wrapper(output_ref[i].data(), mean[i].data(), variance[i].data(),
+                                                               scale[i].data(), shift[i].data(), epsilon,
+                                                               {l.N, l.CO, l.H, l.W}, onednn_timer, true);
+    }
+
+    // check results
+    if (check_equal<float, 4>(output_ref.back(), output_halide, tol)) {
+        printf("Halide results - OK\n");
+    } else {
+        printf("Halide results - FAIL\n");
+        return 1;
+    }
+
+    // the fused tiles, and the intermediate elements they compute: the tiles
+    // of a layer cover its output plus, per tile, the halo of the later layers
+    const int tile_w = LayerStackPipeline::fused_tile(LayerStackPipeline::tile_x, layers[0].W - shape.W);
+    const int tile_h = LayerStackPipeline::fused_tile(LayerStackPipeline::tile_y, layers[0].H - shape.H);
+    const int tiles_x = (shape.W + tile_w - 1) / tile_w, tiles_y = (shape.H + tile_h - 1) / tile_h;
+    double flops = 0, intermediate_bytes = 0, computed_bytes = 0;
+    for (int i = 0; i < L; i++) {
+        const ConvConfig &l = layers[i];
+        flops += 2.0 * l.N * l.CO * l.H * l.W * l.CI * l.KH * l.KW;
+        if (i < L - 1) {
+            intermediate_bytes += 4.0 * output_ref[i].number_of_elements();
+            const int halo_x = l.W - shape.W, halo_y = l.H - shape.H;
+            computed_bytes += 4.0 * l.N * l.CO * (shape.W + tiles_x * halo_x) * (shape.H + tiles_y * halo_y);
+        }
+    }
+    float gflops = flops / 1e9;
+
+    printf("Halide (%s) cold start: %fms\n", use_jit ? "JIT" : "AOT", t_cold * 1e3);
+    print_alloc_stats("Halide", halide_allocs);
+    printf("Halide: %fms, %f GFLOP/s\n", t_halide * 1e3, (gflops / t_halide));
+    printf("oneDNN: %fms, %f GFLOP/s\n", t_onednn * 1e3, (gflops / t_onednn));
+    // written once and read back once per call by a layer-by-layer run
+    printf("intermediates: %.1f MB\n", intermediate_bytes / 1e6);
+    if (fused && intermediate_bytes > 0) {
+        printf("fused tiles: %d x %d, computing the intermediates %.2f times over\n", tile_w, tile_h,
+               computed_bytes / intermediate_bytes);
+    }
+    if (counters) {
+        print_counters("Halide", halide_counters, flops);
+        print_counters("oneDNN", onednn_counters, flops);
+    }
+    printf("\n");
+
+    printf("Success!\n");
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+#ifndef LAYER_STACK_PIPELINE_H
+#define LAYER_STACK_PIPELINE_H
+
+#include "Halide.h"
+#include "pipeline_common.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace Halide;
+
+// One layer of the stack: a dilated conv whose inference-mode batchnorm is
+// folded into the filter and the bias (see fold_batch_norm), then a ReLU.
+struct StackLayer {
+    Func filter, bias;
+    Expr CI, KW, KH, D;
+};
+
+// Works for both ImageParam (JIT) and Input<Buffer<>> (generators). D is the
+// dilation, the same along x and y.
+template <typename InputBuffer>
+inline StackLayer stack_layer(const InputBuffer &filter, const InputBuffer &bias, Expr D) {
+    return {filter, bias, filter.dim(3).extent(), filter.dim(1).extent(), filter.dim(2).extent(), D};
+}
+
+// A chain of conv -> BN -> ReLU layers, stride 1 and unpadded, so every layer
+// reads a (K - 1) * (D + 1) wider input than it writes. Shared by the JIT path
+// in layer_stack.cpp and the AOT generator in generators.cpp.
+//
+// Fused, the output is split into spatial tiles and every earlier layer is
+// computed per tile, over the tile plus the halo the later layers read:
+// overlapping tiles that recompute the halo, but keep every intermediate in
+// cache instead of writing it to memory and reading it back. The halo grows
+// with the dilation, so the tiles grow with it; at large dilations they span
+// the whole image, which is the layer by layer schedule again. A training-mode
+// batchnorm could not be fused this way, since its statistics need the whole
+// conv output first.
+class LayerStackPipeline {
+ public:
+    Var x{"x"}, y{"y"}, c{"c"}, n{"n"};
+    Var co{"co"}, ci{"ci"}, xo{"xo"}, xi{"xi"}, tx{"tx"}, ty{"ty"};
+    std::vector<Func> conv, act;
+    std::vector<RDom> r;
+    Func out;
+    // the halo of the first intermediate, the widest: that of all the later
+    // layers together
+    Expr halo_x = 0, halo_y = 0;
+
+    // output tile of the fused schedule: at least tile_x x tile_y, and
+    // halo_tiles times the halo, so that the tiles recompute at most
+    // (1 + 1 / halo_tiles)^2 of every intermediate. Each layer's
+    // intermediate tile, halo included, is C x (tile + halo) x (tile + halo)
+    // floats.
+    static constexpr int tile_x = 16, tile_y = 8, halo_tiles = 4;
+
+    static int fused_tile(int base, int halo) {
+        return std::max(base, halo_tiles * halo);
+    }
+
+    void define(Func input, const std::vector<StackLayer> &layers) {
+        Func prev = input;
+        for (size_t i = 0; i < layers.size(); i++) {
+            const StackLayer &l = layers[i];
+            conv.emplace_back("conv_" + std::to_string(i));
+            act.emplace_back("act_" + std::to_string(i));
+            r.push_back(RDom(0, l.CI, 0, l.KW, 0, l.KH));
+            const RDom &ri = r.back();
+
+            conv[i](c, x, y, n) = l.bias(c);
+            conv[i](c, x, y, n) += l.filter(c, ri.y, ri.z, ri.x) * prev(ri.x, x + ri.y * (l.D + 1), y + ri.z * (l.D + 1), n);
+            act[i](c, x, y, n) = max(conv[i](c, x, y, n), 0.0f);
+            prev = act[i];
+            if (i > 0) {
+                halo_x += (l.KW - 1) * (l.D + 1);
+                halo_y += (l.KH - 1) * (l.D + 1);
+            }
+        }
+        out = act.back();
+    }
+
+    // `fused` computes the earlier layers per output tile; otherwise every
+    // layer is computed in full before the next, as a sequence of kernels.
+    void schedule(const Target &target, bool fused = true) {
+        const int vec = target.natural_vector_size<float>();
+
+        if (fused) {
+            // fused_tile(), on the runtime dilations
+            Expr tile_w = max(tile_x, halo_tiles * halo_x), tile_h = max(tile_y, halo_tiles * halo_y);
+            out.tile(x, y, tx, ty, x, y, tile_w, tile_h, TailStrategy::GuardWithIf)
+                .parallel(ty)
+                .parallel(n);
+        }
+        for (size_t i = 0; i < act.size(); i++) {
+            schedule_layer(i, vec);
+            if (i + 1 == act.size()) {
+                continue;
+            }
+            if (fused) {
+                act[i].compute_at(out, tx);
+            } else {
+                act[i].compute_root().parallel(y).parallel(n);
+            }
+        }
+        if (!fused) {
+            out.parallel(y).parallel(n);
+        }
+    }
+
+ private:
+    // Register blocking of one layer within whatever region it covers: tiles
+    // of 2 channel vectors by 4 columns, the reduction over those.
+    void schedule_layer(size_t i, int vec) {
+        const int tile_c = 2;
+        const int tile_w = 4;
+        act[i].split(c, co, ci, vec * tile_c, TailStrategy::GuardWithIf)
+            .split(x, xo, xi, tile_w, TailStrategy::GuardWithIf)
+            .reorder(ci, xi, co, xo, y)
+            .vectorize(ci, vec)
+            .unroll(ci)
+            .unroll(xi);
+        conv[i].compute_at(act[i], co)
+            .vectorize(c, vec)
+            .unroll(c)
+            .unroll(x);
+        conv[i].update()
+            .reorder(c, x, r[i].x, r[i].y, r[i].z, y, n)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .unroll(c)
+            .unroll(x);
+    }
+};
+
+#endif
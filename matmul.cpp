@@ -1,97 +1,248 @@
 #include "Halide.h"
 #include "common.h"
+#include "perf_counters.h"
+#include "pool_allocator.h"
+#include "threading.h"
+#include "matmul_pipeline.h"
+#include "halide_gemm_nn.h"
+#include "halide_gemm_nt.h"
+#include "halide_gemm_tn.h"
+#include "halide_gemm_tt.h"
+#include "halide_gemm_blocked_nn.h"
+#include "halide_gemm_blocked_nt.h"
+#include "halide_gemm_blocked_tn.h"
+#include "halide_gemm_blocked_tt.h"
 #include <cstdio>
+#include <map>
+#include <memory>
 
 using namespace Halide;
 using namespace Halide::Tools;
 
-void simple_version(float *A, float *B, float *C, int width, int stride) {
-    for (int iy = 0; iy < width; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            float *cc = C + iy * stride + ix;
-            *cc = 0.0f;
-
-            for (int ik = 0; ik < width; ik++) {
-                *cc = *cc + A[iy * stride + ik] * B[ik * stride + ix];
-            }
-        }
-    }
-}
+// C = alpha * op(A) * op(B) + beta * C on `batch` independent row-major
+// matrices, op(A) being M x K and op(B) K x N; trans is "NN", "NT", "TN" or
+// "TT", as for dnnl_sgemm.
+struct GemmCase {
+    int M, N, K, batch;
+    std::string trans;
+};
+
+// The shapes of --sweep: square with and without tails, larger than the
+// last level cache, small, skinny in each dimension, and batches of small
+// matrices.
+static const std::vector<GemmCase> sweep_cases = {
+    {992, 992, 992, 1, ""},
+    {1000, 1000, 1000, 1, ""},
+    {4096, 4096, 4096, 1, ""},
+    {64, 64, 64, 1, ""},
+    {17, 33, 9, 1, ""},
+    {1, 4096, 4096, 1, ""},
+    {8, 2048, 1024, 1, ""},
+    {4096, 16, 4096, 1, ""},
+    {2048, 2048, 32, 1, ""},
+    {64, 64, 64, 64, ""},
+    {32, 32, 32, 256, ""},
+};
+
+// A JIT-compiled GEMM for one layout, plain or blocked; alpha, beta and
+// the blocking are set per case.
+struct JitGemm {
+    ImageParam A{type_of<float>(), 3}, B{type_of<float>(), 3}, C{type_of<float>(), 3};
+    Param<float> alpha{"alpha"}, beta{"beta"};
+    Param<int> kc{"kc"}, mc{"mc"}, nc{"nc"};
+    GemmPipeline p;
+    BlockedGemmPipeline blocked;
+};
 
 int main(int argc, char **argv) {
-    const int matrix_size = 992;
-
-    ImageParam A(type_of<float>(), 2);
-    ImageParam B(type_of<float>(), 2);
-
-    // define matrix multiplication algorithm
-    Var x("x"), xi("xi"), xo("xo"), y("y"), yo("yo"), yi("yi"), yii("yii"), xii("xii");
-    Func matrix_mul("matrix_mul");
-
-    RDom k(0, matrix_size);
-    RVar ki;
-
-    matrix_mul(x, y) += A(k, y) * B(x, k);
-
-    Func out;
-    out(x, y) = matrix_mul(x, y);
-
-    Var xy;
-
-    // schedules
-    out.tile(x, y, xi, yi, 24, 32)
-        .fuse(x, y, xy)
-        .parallel(xy)
-        .split(yi, yi, yii, 4)
-        .vectorize(xi, 8)
-        .unroll(xi)
-        .unroll(yii);
-
-    matrix_mul.compute_at(out, yi).vectorize(x, 8).unroll(y);
-
-    matrix_mul.update(0)
-        .reorder(x, y, k)
-        .vectorize(x, 8)
-        .unroll(x)
-        .unroll(y)
-        .unroll(k, 2);
-
-    Buffer<float, 2> mat_A(matrix_size, matrix_size);
-    Buffer<float, 2> mat_B(matrix_size, matrix_size);
-    Buffer<float, 2> output_halide(matrix_size, matrix_size);
-
-    // init randomly
-    random_data<float, 2>(mat_A);
-    random_data<float, 2>(mat_B);
-    A.set(mat_A);
-    B.set(mat_B);
-
-    // jit compile and warm-up
-    out.realize(output_halide);
-
-    double t_halide = benchmark(10, 10, [&]() { out.realize(output_halide); });
-
-    // call dnn sgemm
-    Buffer<float, 2> output_ref(matrix_size, matrix_size);
-    double t_onednn = benchmark([&]() {
-        // simple_version(mat_A.data(), mat_B.data(), output_ref.data(), mat_A.width(), mat_A.stride(1));
-        dnnl_sgemm('N', 'N', matrix_size, matrix_size, matrix_size, 1.0f,
-                   mat_A.data(), matrix_size, mat_B.data(), matrix_size, 0.0f,
-                   output_ref.data(), matrix_size);
-    });
-
-    // check results
-    if (check_equal<float, 2>(output_ref, output_halide)) {
-        printf("Halide results - OK\n");
-    } else {
-        printf("Halide results - FAIL\n");
+    // --threads, --pin and --numa size and place the Halide and oneDNN thread
+    // pools; this runs before any buffer is allocated (see threading.h)
+    ThreadConfig threading;
+    if (!take_threading(argc, argv, threading)) {
+        return 1;
+    }
+    print_threading(threading);
+    // --alloc system|pool|huge picks the allocator of the Halide intermediates (see pool_allocator.h)
+    if (!take_allocator(argc, argv)) {
         return 1;
     }
+    // --shape M,N,K and --batch set the problem, --trans the layouts of A and B
+    GemmCase shape = {};
+    if (sscanf(take_option(argc, argv, "--shape", "992,992,992"), "%d,%d,%d", &shape.M, &shape.N, &shape.K) != 3) {
+        printf("--shape expects M,N,K\n");
+        return 1;
+    }
+    shape.batch = atoi(take_option(argc, argv, "--batch", "1"));
+    shape.trans = take_option(argc, argv, "--trans", "NN");
+    const float alpha = atof(take_option(argc, argv, "--alpha", "1"));
+    const float beta = atof(take_option(argc, argv, "--beta", "0"));
+    // --sweep runs the shapes of sweep_cases, with the layouts of --trans
+    const bool sweep = take_flag(argc, argv, "--sweep");
+    // --counters also reports hardware counters (perf_event_open) of both runs
+    const bool counters = take_flag(argc, argv, "--counters");
+    // --atol, --rtol and --ulp set the tolerances of the result check; the
+    // outputs are sums of K products, so a relative bound as well
+    Tolerance def_tol;
+    def_tol.rel = 1e-5f;
+    const Tolerance tol = take_tolerance(argc, argv, def_tol);
+    // the AOT kernels from generators.cpp are the default, --jit builds the pipelines at runtime
+    const bool use_jit = take_flag(argc, argv, "--jit");
+    // --blocked runs the cache-blocked GEMM with packed panels, for matrices
+    // larger than the last level cache; its blocking comes from the cache sizes
+    const bool blocked = take_flag(argc, argv, "--blocked");
+    const CacheSizes caches = cache_sizes();
+
+    const std::map<std::string, decltype(&halide_gemm_nn)> aot_kernels = {
+        {"NN", halide_gemm_nn}, {"NT", halide_gemm_nt}, {"TN", halide_gemm_tn}, {"TT", halide_gemm_tt}};
+    const std::map<std::string, decltype(&halide_gemm_blocked_nn)> aot_blocked_kernels = {
+        {"NN", halide_gemm_blocked_nn}, {"NT", halide_gemm_blocked_nt},
+        {"TN", halide_gemm_blocked_tn}, {"TT", halide_gemm_blocked_tt}};
+    if (!aot_kernels.count(shape.trans)) {
+        printf("--trans expects NN, NT, TN or TT\n");
+        return 1;
+    }
+    if (shape.M < 1 || shape.N < 1 || shape.K < 1 || shape.batch < 1) {
+        printf("--shape and --batch must be positive\n");
+        return 1;
+    }
+    std::vector<GemmCase> cases = {shape};
+    if (sweep) {
+        cases = sweep_cases;
+        for (GemmCase &c : cases) {
+            c.trans = shape.trans;
+        }
+    }
+    const bool ta = shape.trans[0] == 'T', tb = shape.trans[1] == 'T';
+    printf("layout: %s, alpha %g, beta %g\n", shape.trans.c_str(), alpha, beta);
+    if (blocked) {
+        printf("caches: L1 %d KB, L2 %d KB, L3 %d KB\n", caches.l1 >> 10, caches.l2 >> 10, caches.l3 >> 10);
+    }
 
-    float gflops = 2.0f * matrix_size * matrix_size * matrix_size / 1e9f;
+    // one JIT pipeline serves every shape of the layout
+    std::unique_ptr<JitGemm> jit;
+    bool cold = true;
+    for (const GemmCase &c : cases) {
+        const int M = c.M, N = c.N, K = c.K, batch = c.batch;
+        // row-major matrices as (column, row, batch) buffers
+        Buffer<float, 3> mat_A = ta ? Buffer<float, 3>(M, K, batch) : Buffer<float, 3>(K, M, batch);
+        Buffer<float, 3> mat_B = tb ? Buffer<float, 3>(K, N, batch) : Buffer<float, 3>(N, K, batch);
+        Buffer<float, 3> mat_C(N, M, batch);
+        Buffer<float, 3> output_halide(N, M, batch);
+        Buffer<float, 3> output_ref(N, M, batch);
+
+        // init randomly
+        random_data<float, 3>(mat_A);
+        random_data<float, 3>(mat_B);
+        random_data<float, 3>(mat_C);
+
+        const BlockedGemmPipeline::Blocking blocking =
+            BlockedGemmPipeline::blocking(caches.l1, caches.l2, caches.l3, M, threading.threads);
+
+        // cold start: pipeline construction, compilation (JIT only) and the first call
+        auto cold_start = benchmark_now();
+        std::function<void()> run;
+        if (use_jit) {
+            if (!jit) {
+                jit.reset(new JitGemm);
+                Expr K_extent = ta ? jit->A.dim(1).extent() : jit->A.dim(0).extent();
+                if (blocked) {
+                    Expr M_extent = ta ? jit->A.dim(0).extent() : jit->A.dim(1).extent();
+                    Expr N_extent = tb ? jit->B.dim(1).extent() : jit->B.dim(0).extent();
+                    jit->blocked.define(jit->A, jit->B, jit->C, M_extent, N_extent, K_extent, jit->alpha, jit->beta,
+                                        ta, tb, jit->kc, jit->mc, jit->nc);
+                    jit->blocked.schedule();
+                } else {
+                    jit->p.define(jit->A, jit->B, jit->C, K_extent, jit->alpha, jit->beta, ta, tb);
+                    jit->p.schedule();
+                }
+                Func &out = blocked ? jit->blocked.out : jit->p.out;
+                use_allocator(out);
+                out.compile_jit(get_jit_target_from_environment());
+            }
+            run = [&]() {
+                jit->A.set(mat_A);
+                jit->B.set(mat_B);
+                jit->C.set(mat_C);
+                jit->alpha.set(alpha);
+                jit->beta.set(beta);
+                jit->kc.set(blocking.kc);
+                jit->mc.set(blocking.mc);
+                jit->nc.set(blocking.nc);
+                (blocked ? jit->blocked.out : jit->p.out).realize(output_halide);
+            };
+        } else if (blocked) {
+            auto kernel = aot_blocked_kernels.at(c.trans);
+            run = [&, kernel]() {
+                kernel(mat_A.raw_buffer(), mat_B.raw_buffer(), mat_C.raw_buffer(), alpha, beta,
+                       blocking.kc, blocking.mc, blocking.nc, output_halide.raw_buffer());
+            };
+        } else {
+            auto kernel = aot_kernels.at(c.trans);
+            run = [&, kernel]() {
+                kernel(mat_A.raw_buffer(), mat_B.raw_buffer(), mat_C.raw_buffer(), alpha, beta,
+                       output_halide.raw_buffer());
+            };
+        }
+        run();
+        double t_cold = benchmark_duration_seconds(cold_start, benchmark_now());
+
+        // small cases run in microseconds, so both sides use the adaptive benchmark
+        double t_halide = benchmark(run);
+        // allocations of one call, once the pools are warm
+        AllocStats alloc_before = alloc_stats();
+        run();
+        AllocStats halide_allocs = alloc_stats() - alloc_before;
+
+        // call dnn sgemm, once per batch entry; beta reads the output, so it
+        // starts from C as Halide's does
+        memcpy(output_ref.data(), mat_C.data(), output_ref.size_in_bytes());
+        std::function<void()> run_onednn = [&]() {
+            for (int b = 0; b < batch; b++) {
+                dnnl_sgemm(c.trans[0], c.trans[1], M, N, K, alpha,
+                           &mat_A(0, 0, b), ta ? M : K, &mat_B(0, 0, b), tb ? K : N, beta,
+                           &output_ref(0, 0, b), N);
+            }
+        };
+        double t_onednn = benchmark(run_onednn);
 
-    printf("Halide: %fms, %f GFLOP/s\n", t_halide * 1e3, (gflops / t_halide));
-    printf("oneDNN: %fms, %f GFLOP/s\n\n", t_onednn * 1e3, (gflops / t_onednn));
+        PerfSample halide_counters, onednn_counters;
+        if (counters) {
+            halide_counters = measure_counters(run);
+            onednn_counters = measure_counters(run_onednn);
+        }
+        // beta reads the output, which the timed calls have accumulated into:
+        // the reference is computed once more from C
+        memcpy(output_ref.data(), mat_C.data(), output_ref.size_in_bytes());
+        run_onednn();
+
+        printf("M=%d N=%d K=%d, batch %d\n", M, N, K, batch);
+        if (blocked) {
+            printf("blocking: kc %d, mc %d rows, nc %d columns\n", blocking.kc,
+                   blocking.mc * BlockedGemmPipeline::mr, blocking.nc * BlockedGemmPipeline::nr);
+        }
+        // check results
+        if (check_equal<float, 3>(output_ref, output_halide, tol)) {
+            printf("Halide results - OK\n");
+        } else {
+            printf("Halide results - FAIL\n");
+            return 1;
+        }
+
+        float gflops = 2.0f * M * N * K * batch / 1e9f;
+
+        if (cold) {
+            printf("Halide (%s) cold start: %fms\n", use_jit ? "JIT" : "AOT", t_cold * 1e3);
+            cold = false;
+        }
+        print_alloc_stats("Halide", halide_allocs);
+        printf("Halide: %fms, %f GFLOP/s\n", t_halide * 1e3, (gflops / t_halide));
+        printf("oneDNN: %fms, %f GFLOP/s\n", t_onednn * 1e3, (gflops / t_onednn));
+        if (counters) {
+            print_counters("Halide", halide_counters, gflops * 1e9);
+            print_counters("oneDNN", onednn_counters, gflops * 1e9);
+        }
+        printf("\n");
+    }
 
     printf("Success!\n");
     return 0;
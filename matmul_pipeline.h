@@ -0,0 +1,269 @@
+#ifndef MATMUL_PIPELINE_H
+#define MATMUL_PIPELINE_H
+
+#include "Halide.h"
+
+#include <algorithm>
+
+using namespace Halide;
+
+// Blocked SGEMM. Shared by the JIT path in matmul.cpp and the AOT generator
+// in generators.cpp, so both modes run exactly the same schedule.
+class MatmulPipeline {
+ public:
+    // Register blocking of the schedule, also used by the im2col convolution:
+    // tile_x x tile_y output tiles computed in strips of `strip` rows, with
+    // vectors of `vec` columns and the reduction unrolled by `unroll_k`.
+    static constexpr int tile_x = 24, tile_y = 32, strip = 4, vec = 8, unroll_k = 2;
+
+    Var x{"x"}, y{"y"}, xi{"xi"}, yi{"yi"}, yii{"yii"}, xy{"xy"};
+    Func matrix_mul{"matrix_mul"}, out{"out"};
+    RDom k;
+
+    // define matrix multiplication algorithm
+    void define(Func A, Func B, int matrix_size) {
+        k = RDom(0, matrix_size);
+
+        matrix_mul(x, y) += A(k, y) * B(x, k);
+
+        out(x, y) = matrix_mul(x, y);
+    }
+
+    void schedule() {
+        out.tile(x, y, xi, yi, tile_x, tile_y)
+            .fuse(x, y, xy)
+            .parallel(xy)
+            .split(yi, yi, yii, strip)
+            .vectorize(xi, vec)
+            .unroll(xi)
+            .unroll(yii);
+
+        matrix_mul.compute_at(out, yi).vectorize(x, vec).unroll(y);
+
+        matrix_mul.update(0)
+            .reorder(x, y, k)
+            .vectorize(x, vec)
+            .unroll(x)
+            .unroll(y)
+            .unroll(k, unroll_k);
+    }
+};
+
+// General SGEMM over a batch of row-major matrices,
+//   C'(b) = alpha * op(A(b)) * op(B(b)) + beta * C(b),
+// op(A) being M x K and op(B) K x N, with every extent read from the
+// buffers at runtime. Buffers are (column, row, batch): A is (K, M, batch),
+// or (M, K, batch) when transposed, and B is (N, K, batch), or (K, N, batch).
+// The transposes are compile time options, since they change the schedule.
+//
+// The register blocking is that of MatmulPipeline. A transposed A is still
+// read one scalar per row; a transposed B is copied per output tile into a
+// (column, k) panel, so the inner loop keeps its contiguous vector loads.
+// With beta = 0, C is not read, as in BLAS: out has a branch of its own
+// for it, in which the select folds away.
+class GemmPipeline {
+ public:
+    static constexpr int tile_x = MatmulPipeline::tile_x, tile_y = MatmulPipeline::tile_y;
+    static constexpr int strip = MatmulPipeline::strip, vec = MatmulPipeline::vec, unroll_k = MatmulPipeline::unroll_k;
+
+    Var x{"x"}, y{"y"}, b{"b"}, xi{"xi"}, yi{"yi"}, yii{"yii"}, xy{"xy"};
+    Func matrix_mul{"matrix_mul"}, b_panel{"b_panel"}, out{"out"};
+    Expr K, beta;
+    RDom k;
+
+    // K is the reduction extent, the columns of op(A); M and N come from the
+    // output buffer
+    void define(Func A, Func B, Func C, Expr K, Expr alpha, Expr beta, bool transpose_a, bool transpose_b) {
+        this->K = K;
+        this->beta = beta;
+        this->transpose_b = transpose_b;
+        k = RDom(0, K);
+
+        Func a_op, b_op;
+        a_op(x, y, b) = transpose_a ? A(y, x, b) : A(x, y, b);
+        b_panel(x, y, b) = transpose_b ? B(y, x, b) : B(x, y, b);
+
+        matrix_mul(x, y, b) = 0.0f;
+        matrix_mul(x, y, b) += a_op(k, y, b) * b_panel(x, k, b);
+
+        out(x, y, b) = select(beta == 0.0f, alpha * matrix_mul(x, y, b),
+                              alpha * matrix_mul(x, y, b) + beta * C(x, y, b));
+    }
+
+    // Output tiles are specialized on the shape, from the fastest to the most
+    // general: tiles that divide the matrix; at least one full tile, the last
+    // shifted inwards; small or skinny matrices, at least a vector by a strip,
+    // in vector by strip tiles; anything smaller, guarded. Each shape is
+    // there twice, under beta = 0 and otherwise.
+    void schedule() {
+        schedule_shapes(out.specialize(beta == 0.0f));
+        schedule_shapes(out);
+
+        matrix_mul.compute_at(out, yi)
+            .vectorize(x, vec, TailStrategy::GuardWithIf)
+            .unroll(y);
+        matrix_mul.update(0)
+            .reorder(x, y, k)
+            .vectorize(x, vec, TailStrategy::GuardWithIf)
+            .unroll(x)
+            .unroll(y);
+        // an odd K would put a guard into the unrolled reduction
+        matrix_mul.update(0).specialize(K % unroll_k == 0).unroll(k, unroll_k);
+
+        if (transpose_b) {
+            b_panel.compute_at(out, xy)
+                .vectorize(x, vec, TailStrategy::GuardWithIf);
+        }
+    }
+
+ private:
+    bool transpose_b = false;
+
+    void schedule_shapes(Stage stage) {
+        Expr cols = out.output_buffer().dim(0).extent();
+        Expr rows = out.output_buffer().dim(1).extent();
+        schedule_tiles(stage.specialize(cols % tile_x == 0 && rows % tile_y == 0), tile_x, tile_y,
+                       TailStrategy::ShiftInwards);
+        schedule_tiles(stage.specialize(cols >= tile_x && rows >= tile_y), tile_x, tile_y,
+                       TailStrategy::ShiftInwards);
+        schedule_tiles(stage.specialize(cols >= vec && rows >= strip), vec, strip, TailStrategy::ShiftInwards);
+        schedule_tiles(stage, vec, strip, TailStrategy::GuardWithIf);
+    }
+
+    // tx x ty output tiles in strips of at most `strip` rows; every branch
+    // uses the same loop names, so matrix_mul and b_panel can compute_at them
+    void schedule_tiles(Stage stage, int tx, int ty, TailStrategy tail) {
+        stage.tile(x, y, xi, yi, tx, ty, tail)
+            .fuse(x, y, xy)
+            .split(yi, yi, yii, std::min(strip, ty), tail)
+            .vectorize(xi, vec)
+            .unroll(xi)
+            .unroll(yii)
+            .parallel(xy)
+            .parallel(b);
+    }
+};
+
+// The GEMM of GemmPipeline blocked for the cache hierarchy, for matrices
+// that do not fit in the last level cache. GemmPipeline reduces over all of
+// K inside each output tile and reads B a whole row apart at every step;
+// here, as in GotoBLAS:
+//  - K is split into blocks of kc, and each K block of B is packed into
+//    nr-column micro-panels (k-major, nr contiguous), nc columns at a time,
+//    to stay in the last level cache;
+//  - per block of mc rows, A is packed into mr-row micro-panels, to stay in
+//    L2 while the B panels stream past it;
+//  - the micro-kernel keeps an nr x mr tile of C in registers over one K
+//    block, with an nr x kc micro-panel of B in L1, and adds it into the
+//    output, so C goes through memory once per K block.
+// The packing absorbs the transposes, and pads M, N and K with zeros to
+// whole tiles and blocks, so the micro-kernel has no tails at all. kc, mc
+// and nc (the last two in micro tiles) are runtime parameters, sized from
+// the cache sizes of the machine by blocking().
+class BlockedGemmPipeline {
+ public:
+    // micro tile: the register blocking of MatmulPipeline
+    static constexpr int nr = MatmulPipeline::tile_x, mr = MatmulPipeline::strip, vec = MatmulPipeline::vec;
+
+    struct Blocking {
+        int kc, mc, nc;
+    };
+
+    // kc fills half of L1 with a B micro-panel, mc half of L2 with the packed
+    // A block, nc half of the last level cache with the packed B block. The
+    // row blocks are the parallel tasks, so mc also leaves one per thread for
+    // the M rows.
+    static Blocking blocking(int l1_bytes, int l2_bytes, int l3_bytes, int M, int threads) {
+        const int bytes = sizeof(float);
+        Blocking b;
+        b.kc = std::max(16, l1_bytes / 2 / (nr * bytes) / 8 * 8);
+        b.mc = std::max(1, l2_bytes / 2 / (b.kc * mr * bytes));
+        b.nc = std::max(1, l3_bytes / 2 / (b.kc * nr * bytes));
+        const int row_tiles = (M + mr - 1) / mr;
+        b.mc = std::max(1, std::min(b.mc, (row_tiles + threads - 1) / threads));
+        return b;
+    }
+
+    Var x{"x"}, y{"y"}, b{"b"}, k{"k"}, xr{"xr"}, yr{"yr"}, xt{"xt"}, yt{"yt"}, xc{"xc"}, yc{"yc"}, kb{"kb"};
+    Func a_packed{"a_packed"}, b_packed{"b_packed"}, acc{"acc"}, out{"out"};
+    RDom ki, rk;
+
+    // M, N and K are the extents of op(A) and op(B), kc the K block, mc and
+    // nc the row and column blocks in micro tiles
+    void define(Func A, Func B, Func C, Expr M, Expr N, Expr K, Expr alpha, Expr beta,
+                bool transpose_a, bool transpose_b, Expr kc, Expr mc, Expr nc) {
+        this->beta = beta;
+        this->mc = mc;
+        this->nc = nc;
+        ki = RDom(0, kc, "ki");
+        rk = RDom(0, (K + kc - 1) / kc, "rk");
+
+        Func a_op, b_op;
+        a_op(k, y, b) = transpose_a ? A(y, k, b) : A(k, y, b);
+        b_op(x, k, b) = transpose_b ? B(k, x, b) : B(x, k, b);
+
+        // micro-panels, zero beyond the matrices
+        Expr row = yt * mr + yr, col = xt * nr + xr;
+        a_packed(yr, k, yt, b) = select(likely(row < M && k < K),
+                                        a_op(clamp(k, 0, K - 1), clamp(row, 0, M - 1), b), 0.0f);
+        b_packed(xr, k, xt, b) = select(likely(col < N && k < K),
+                                        b_op(clamp(col, 0, N - 1), clamp(k, 0, K - 1), b), 0.0f);
+
+        // one K block of C, consumed one micro tile at a time
+        acc(x, y, kb, b) = 0.0f;
+        acc(x, y, kb, b) += a_packed(y % mr, kb * kc + ki, y / mr, b) * b_packed(x % nr, kb * kc + ki, x / nr, b);
+
+        // the beta pass of BLAS, then the K blocks accumulated into the output
+        // in place
+        out(x, y, b) = select(beta == 0.0f, 0.0f, beta * C(x, y, b));
+        out(x, y, b) += alpha * acc(x, y, rk, b);
+    }
+
+    void schedule() {
+        // beta = 0 has a branch of its own, which does not read C
+        for (Stage stage : {out.specialize(beta == 0.0f), Stage(out)}) {
+            stage.vectorize(x, vec, TailStrategy::GuardWithIf)
+                .parallel(y);
+        }
+
+        // loop nest of GotoBLAS: column blocks, K blocks, row blocks in
+        // parallel, then the micro tiles, columns outside rows so the B
+        // micro-panel stays in L1; GuardWithIf keeps x % nr and y % mr exact
+        // within a tile
+        out.update()
+            .split(x, xt, xr, nr, TailStrategy::GuardWithIf)
+            .split(y, yt, yr, mr, TailStrategy::GuardWithIf)
+            .split(xt, xc, xt, nc, TailStrategy::GuardWithIf)
+            .split(yt, yc, yt, mc, TailStrategy::GuardWithIf)
+            .reorder(xr, yr, yt, xt, yc, rk, xc, b)
+            .vectorize(xr, vec)
+            .unroll(xr)
+            .unroll(yr)
+            .parallel(yc);
+
+        // the micro-kernel: one micro tile over one K block, in registers
+        acc.compute_at(out, yt)
+            .store_in(MemoryType::Register)
+            .vectorize(x, vec)
+            .unroll(x)
+            .unroll(y);
+        acc.update()
+            .reorder(x, y, ki, kb, b)
+            .vectorize(x, vec)
+            .unroll(x)
+            .unroll(y);
+
+        // packed once per K block (B) and per row block within it (A)
+        b_packed.compute_at(out, rk)
+            .vectorize(xr, vec)
+            .unroll(xr)
+            .parallel(xt);
+        a_packed.compute_at(out, yc)
+            .unroll(yr);
+    }
+
+ private:
+    Expr beta, mc, nc;
+};
+
+#endif
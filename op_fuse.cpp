@@ -1,5 +1,12 @@
 #include "Halide.h"
 #include "common.h"
+#include "perf_counters.h"
+#include "pool_allocator.h"
+#include "threading.h"
+#include "op_fuse_pipeline.h"
+#include "dilated_conv_pipeline.h"
+#include "halide_op_fuse.h"
+#include "halide_dilated_conv_bias.h"
 
 #include <stdio.h>
 
@@ -7,133 +14,158 @@ using namespace Halide;
 using namespace Halide::Tools;
 
 int main(int argc, char **argv) {
-    const int N = 5, CI = 128, CO = 128, W = 100, H = 80, KW = 3, KH = 3;
-    const int dilation = (argc > 1) ? atoi(argv[1]) : 31;
+    // --threads, --pin and --numa size and place the Halide and oneDNN thread
+    // pools; this runs before any buffer is allocated (see threading.h)
+    ThreadConfig threading;
+    if (!take_threading(argc, argv, threading)) {
+        return 1;
+    }
+    print_threading(threading);
+    // --alloc system|pool|huge picks the allocator of the Halide intermediates (see pool_allocator.h)
+    if (!take_allocator(argc, argv)) {
+        return 1;
+    }
+    // the pipelines read the layer shape from their buffers, --shape N,CI,CO,W,H,KW,KH overrides the default
+    ConvConfig shape = {};
+    if (!parse_conv_shape(take_option(argc, argv, "--shape", "5,128,128,100,80,3,3"), shape)) {
+        printf("--shape expects N,CI,CO,W,H,KW,KH\n");
+        return 1;
+    }
+    const int N = shape.N, CI = shape.CI, CO = shape.CO, W = shape.W, H = shape.H, KW = shape.KW, KH = shape.KH;
+    // --counters also reports hardware counters (perf_event_open) of both runs
+    const bool counters = take_flag(argc, argv, "--counters");
+    // --atol, --rtol and --ulp set the tolerances of the result check
+    const Tolerance tol = take_tolerance(argc, argv);
+    // the AOT kernel from generators.cpp is the default, --jit builds the pipeline at runtime
+    const bool use_jit = take_flag(argc, argv, "--jit");
+    // --inference normalizes with fixed running statistics, folded into the
+    // conv filter and a bias at load time, instead of batch statistics
+    const bool inference = take_flag(argc, argv, "--inference");
+    // dilation is a runtime parameter of the compiled pipeline; DH defaults to DW
+    const int DW = (argc > 1) ? atoi(argv[1]) : 31;
+    const int DH = (argc > 2) ? atoi(argv[2]) : DW;
     const float epsilon = 1.e-9f;
 
     ImageParam input(type_of<float>(), 4);
     ImageParam filter(type_of<float>(), 4);
+    ImageParam bias(type_of<float>(), 1);
+    Param<int> dw("DW"), dh("DH");
+    OpFusePipeline p;
+    DilatedConvPipeline p_folded;
+    Func out;
 
-    // define a fused operator
-    // TODO: you may rewrite this part
-    Var x("x"), y("y"), c("c"), n("n");
-
-    Func dilated_conv("dilated_conv");
-    RDom r(0, CI, 0, KW, 0, KH);
-
-    dilated_conv(c, x, y, n) = 0.0f;
-    dilated_conv(c, x, y, n) += filter(c, r.y, r.z, r.x) * input(r.x, x + r.y * (dilation + 1), y + r.z * (dilation + 1), n);
-    printf("dilation: %d\n", dilation);
-    Func mu("mu"), sigma("sigma"), out("out"), tmp("tmp");
-    Func inv_sqrt("inv_sqrt");
-    RDom s(0, W, 0, H, 0, N);
-    // Func sum_conv("sum_conv");
-    // Var ci("ci"), kw("kw"), kh("kh");
-
-    // sum_conv(ci, kw, kh) = Halide::sum(input(ci, s.x + kw * (dilation + 1), s.y + kh * (dilation + 1), s.z));
-    // mu(c) = Halide::sum(filter(c, r.y, r.z, r.x) * sum_conv(r.x, r.y, r.z)) / (N * H * W);
-
-    tmp(c, x, y, n) = dilated_conv(c, x, y, n);
-    mu(c) = Halide::sum(tmp(c, s.x, s.y, s.z)) / (N * H * W);
-
-    sigma(c) = Halide::sum(pow((tmp(c, s.x, s.y, s.z) - mu(c)), 2)) / (N * H * W);
-    inv_sqrt(c) = 1 / sqrt(sigma(c) + epsilon);
-
-    out(c, x, y, n) = (tmp(c, x, y, n) - mu(c)) * inv_sqrt(c);
-    
-    // TODO: write Halide schedules below
-    Target target = get_jit_target_from_environment();
-    const int vec = target.natural_vector_size<float>();
-
-    const int tile_w = 4;
-    const int tile_h = 4;
-    Var co("co"), ci("ci"), xo("xo"), xi("xi"), yo("yo"), yi("yi"), t("t");
-
-    out.split(c, co, ci, vec * tile_w)
-        .split(x, xo, xi, tile_h)
-        .reorder(ci, xi, xo, y, n, co)
-        .vectorize(ci, vec)
-        .unroll(ci)
-        .unroll(xi)
-        .parallel(y)
-        .parallel(n)
-        .parallel(co);
+    printf("dilation: %d x %d\n", DW, DH);
+    printf("batchnorm: %s\n", inference ? "inference (folded)" : "training");
 
-    mu.compute_at(out, co)
-        .split(c, co, ci, vec * tile_w)
-        .reorder(ci, co)
-        .vectorize(ci, vec)
-        .unroll(ci)
-        .parallel(co);
-    inv_sqrt.compute_at(out, co)
-        .split(c, co, ci, vec * tile_w)
-        .reorder(ci, co)
-        .vectorize(ci, vec)
-        .unroll(ci)
-        .parallel(co);
-
-    tmp.compute_at(out, co)
-        .split(c, co, ci, vec * tile_w)
-        .split(x, xo, xi, tile_h)
-        .reorder(ci, xi, xo, y, n, co)
-        .vectorize(ci, vec)
-        .unroll(ci)
-        .unroll(xi)
-        .parallel(y)
-        .parallel(n)
-        .parallel(co);
-
-    dilated_conv.compute_at(tmp, xo)
-        .vectorize(c, vec)
-        .unroll(c)
-        .unroll(x)
-        .unroll(y)
-        .update()
-        .reorder(c, x, y, r.x, r.y, r.z, n)
-        .vectorize(c, vec)
-        .unroll(c)
-        .unroll(x)
-        .unroll(y)
-        .unroll(r.x, 2);
-
-    filter.in().compute_at(dilated_conv, r.x)
-        .vectorize(_0, vec)
-        .unroll(_0)
-        .unroll(_3);
-    input.in().compute_at(dilated_conv, x)
-        .unroll(_0);
-
-    Buffer<float, 4> in(CI, W + (KW - 1) * (dilation + 1), H + (KH - 1) * (dilation + 1), N);
+    Buffer<float, 4> in(CI, W + (KW - 1) * (DW + 1), H + (KH - 1) * (DH + 1), N);
     Buffer<float, 4> fil(CO, KW, KH, CI);
     Buffer<float, 4> output_halide(CO, W, H, N);
 
     // init randomly
     random_data<float, 4>(in);
     random_data<float, 4>(fil);
-    input.set(in);
-    filter.set(fil);
 
-    // jit compile and warm-up
-    out.realize(output_halide);
+    // running statistics of the same order as those of the random conv
+    // output, so the normalized values are O(1) as in a trained network
+    const float taps = CI * KW * KH;
+    Buffer<float, 1> mean(CO), variance(CO), scale(CO), shift(CO);
+    random_data<float, 1>(mean);
+    random_data<float, 1>(variance);
+    random_data<float, 1>(scale);
+    random_data<float, 1>(shift);
+    mean.for_each_value([&](float &m) { m = taps * (0.2f + 0.1f * m); });
+    variance.for_each_value([&](float &v) { v = taps * (0.04f + 0.04f * v); });
+
+    // load time: fold the batchnorm into the filter and a bias
+    Buffer<float, 4> fil_folded(CO, KW, KH, CI);
+    Buffer<float, 1> bias_folded(CO);
+    double t_fold = 0;
+    if (inference) {
+        auto fold_start = benchmark_now();
+        fold_batch_norm(fil, mean, variance, scale, shift, epsilon, fil_folded, bias_folded);
+        t_fold = benchmark_duration_seconds(fold_start, benchmark_now());
+    }
+
+    // cold start: pipeline construction, compilation (JIT only) and the first call
+    auto cold_start = benchmark_now();
+    std::function<void()> run;
+    if (use_jit) {
+        Target target = get_jit_target_from_environment();
+        if (inference) {
+            p_folded.define(input, filter, conv_shape(input, filter, dw, dh), dw, dh, bias);
+            p_folded.schedule(target);
+            out = p_folded.out;
+            filter.set(fil_folded);
+            bias.set(bias_folded);
+        } else {
+            p.define(input, filter, conv_shape(input, filter, dw, dh), dw, dh, epsilon);
+            p.schedule(target);
+            out = p.out;
+            filter.set(fil);
+        }
+        input.set(in);
+        dw.set(DW);
+        dh.set(DH);
+        use_allocator(out);
+        out.compile_jit(target);
+        run = [&]() { out.realize(output_halide); };
+    } else if (inference) {
+        run = [&]() { halide_dilated_conv_bias(in.raw_buffer(), fil_folded.raw_buffer(), bias_folded.raw_buffer(), DW, DH, output_halide.raw_buffer()); };
+    } else {
+        run = [&]() { halide_op_fuse(in.raw_buffer(), fil.raw_buffer(), DW, DH, output_halide.raw_buffer()); };
+    }
+    run();
+    double t_cold = benchmark_duration_seconds(cold_start, benchmark_now());
     // NOTE: uncomment next line if time is unstable
-    // double t_halide = benchmark(10, 10, [&]() { dilated_conv.realize(output_halide); });
-    double t_halide = benchmark(1, 1, [&]() { out.realize(output_halide); });
+    // double t_halide = benchmark(10, 10, run);
+    double t_halide = benchmark(1, 1, run);
+    // allocations of one call, once the pools are warm
+    AllocStats alloc_before = alloc_stats();
+    run();
+    AllocStats halide_allocs = alloc_stats() - alloc_before;
+    // the oneDNN wrappers time through this, which also collects its counters
+    PerfSample halide_counters, onednn_counters;
+    auto onednn_timer = [&](const std::function<void()> &op) {
+        double t = fixed_benchmark(op);
+        if (counters) {
+            onednn_counters += measure_counters(op);
+        }
+        return t;
+    };
+    if (counters) {
+        halide_counters = measure_counters(run);
+    }
 
     Buffer<float, 4> output_ref(CO, W, H, N);
     // call dilated conv and bnorm seperately in oneDNN
-    double t_onednn = dnnl_dilated_conv_wrapper(in.data(), fil.data(), output_ref.data(), {N, CI, CO, W, H, KW, KH, dilation, dilation});
-    t_onednn += dnnl_batch_normalization_wrapper(output_ref.data(), epsilon, {N, CO, H, W});
+    double t_onednn = dnnl_dilated_conv_wrapper(in.data(), fil.data(), output_ref.data(), {N, CI, CO, W, H, KW, KH, DW, DH}, onednn_timer);
+    if (inference) {
+        t_onednn += dnnl_batch_normalization_inference_wrapper(output_ref.data(), mean.data(), variance.data(),
+                                                               scale.data(), shift.data(), epsilon, {N, CO, H, W}, onednn_timer);
+    } else {
+        t_onednn += dnnl_batch_normalization_wrapper(output_ref.data(), epsilon, {N, CO, H, W}, onednn_timer);
+    }
 
     // check results
-    if (check_equal<float, 4>(output_ref, output_halide)) {
+    if (check_equal<float, 4>(output_ref, output_halide, tol)) {
         printf("Halide results - OK\n");
     } else {
         printf("Halide results - FAIL\n");
         return 1;
     }
 
+    printf("Halide (%s) cold start: %fms\n", use_jit ? "JIT" : "AOT", t_cold * 1e3);
+    print_alloc_stats("Halide", halide_allocs);
+    if (inference) {
+        printf("batchnorm folding (once): %fms\n", t_fold * 1e3);
+    }
     printf("Halide: %fms\n", t_halide * 1e3);
-    printf("oneDNN: %fms\n\n", t_onednn * 1e3);
+    printf("oneDNN: %fms\n", t_onednn * 1e3);
+    if (counters) {
+        print_counters("Halide", halide_counters, 2.0 * N * CO * H * W * CI * KH * KW);
+        print_counters("oneDNN", onednn_counters, 2.0 * N * CO * H * W * CI * KH * KW);
+    }
+    printf("\n");
 
     printf("Success!\n");
 
@@ -0,0 +1,144 @@
+#ifndef OP_FUSE_PIPELINE_H
+#define OP_FUSE_PIPELINE_H
+
+#include "Halide.h"
+#include "pipeline_common.h"
+
+using namespace Halide;
+
+// Dilated convolution fused with a training-mode batch normalization.
+// Shared by the JIT path in op_fuse.cpp and the AOT generator in
+// generators.cpp.
+class OpFusePipeline {
+ public:
+    Var x{"x"}, y{"y"}, c{"c"}, n{"n"};
+    Var co{"co"}, ci{"ci"}, xo{"xo"}, xi{"xi"}, v{"v"};
+    Func dilated_conv{"dilated_conv"};
+    Func mu{"mu"}, sigma{"sigma"}, out{"out"}, tmp{"tmp"};
+    Func stats{"stats"}, stats_rows{"stats_rows"}, inv_sqrt{"inv_sqrt"};
+    Func input, filter;
+    Expr DW, DH;
+    RDom r, s;
+
+    // define a fused operator
+    // DW and DH are runtime parameters, so one compiled pipeline serves every dilation
+    void define(Func input, Func filter, const ConvShape &shape, Expr DW, Expr DH, float epsilon) {
+        this->input = input;
+        this->filter = filter;
+        this->DW = DW;
+        this->DH = DH;
+        r = RDom(0, shape.CI, 0, shape.KW, 0, shape.KH);
+        s = RDom(0, shape.W, 0, shape.H, 0, shape.N);
+        Expr count = shape.N * shape.H * shape.W;
+
+        dilated_conv(c, x, y, n) = 0.0f;
+        dilated_conv(c, x, y, n) += filter(c, r.y, r.z, r.x) * input(r.x, x + r.y * (DW + 1), y + r.z * (DH + 1), n);
+
+        tmp(c, x, y, n) = dilated_conv(c, x, y, n);
+
+        // mean and variance in a single pass over tmp: sum and sum of squares
+        // of the values shifted by one sample of the channel, which keeps
+        // the E[x^2] - E[x]^2 form from cancelling catastrophically
+        Expr shift = tmp(c, 0, 0, 0);
+        Expr d = tmp(c, s.x, s.y, s.z) - shift;
+        stats(c) = Tuple(0.0f, 0.0f);
+        stats(c) = Tuple(stats(c)[0] + d, stats(c)[1] + d * d);
+
+        mu(c) = shift + stats(c)[0] / count;
+        sigma(c) = max(stats(c)[1] - stats(c)[0] * stats(c)[0] / count, 0.0f) / count;
+        inv_sqrt(c) = 1 / sqrt(sigma(c) + epsilon);
+
+        out(c, x, y, n) = (tmp(c, x, y, n) - mu(c)) * inv_sqrt(c);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = target.natural_vector_size<float>();
+
+        const int tile_w = 4;
+        const int tile_h = 4;
+
+        specialize_output_tiles(out, vec, tile_w, tile_h, [&](Stage stage, int c_tile, TailStrategy tail) {
+            stage.split(c, co, ci, c_tile, tail)
+                .split(x, xo, xi, tile_h, tail)
+                .reorder(ci, xi, xo, y, n, co)
+                .vectorize(ci, vec)
+                .unroll(ci)
+                .unroll(xi)
+                .parallel(y)
+                .parallel(n)
+                .parallel(co);
+        });
+
+        // the statistics are split into one partial per row of tmp, summed in
+        // parallel and then merged in row order, so the result does not
+        // depend on the thread count
+        stats_rows = stats.update().rfactor(s.y, v);
+        stats_rows.compute_at(out, co)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .update()
+            .reorder(c, s.x, s.z, v)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .parallel(v);
+        stats.compute_at(out, co)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .update()
+            .vectorize(c, vec, TailStrategy::GuardWithIf);
+
+        // mu, inv_sqrt and tmp cover one channel tile of out, which is
+        // narrower than vec * tile_w in the small-shape specializations, so
+        // their splits guard instead of rounding up past the filter
+        mu.compute_at(out, co)
+            .split(c, co, ci, vec * tile_w, TailStrategy::GuardWithIf)
+            .reorder(ci, co)
+            .vectorize(ci, vec)
+            .unroll(ci)
+            .parallel(co);
+        inv_sqrt.compute_at(out, co)
+            .split(c, co, ci, vec * tile_w, TailStrategy::GuardWithIf)
+            .reorder(ci, co)
+            .vectorize(ci, vec)
+            .unroll(ci)
+            .parallel(co);
+
+        tmp.compute_at(out, co)
+            .split(c, co, ci, vec * tile_w, TailStrategy::GuardWithIf)
+            .split(x, xo, xi, tile_h, TailStrategy::GuardWithIf)
+            .reorder(ci, xi, xo, y, n, co)
+            .vectorize(ci, vec)
+            .unroll(ci)
+            .unroll(xi)
+            .parallel(y)
+            .parallel(n)
+            .parallel(co);
+
+        dilated_conv.compute_at(tmp, xo)
+            .vectorize(c, vec)
+            .unroll(c)
+            .unroll(x)
+            .unroll(y)
+            .update()
+            .reorder(c, x, y, r.x, r.y, r.z, n)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .unroll(c)
+            .unroll(x)
+            .unroll(y)
+            .unroll(r.x, 2);
+
+        filter.in().compute_at(dilated_conv, r.x)
+            .vectorize(_0, vec, TailStrategy::GuardWithIf)
+            .unroll(_0)
+            .unroll(_3);
+        input.in().compute_at(dilated_conv, x)
+            .unroll(_0);
+
+        // constant-fold the input offsets for the common dilations; the
+        // specializations inherit the schedule above
+        for (int d : common_dilations) {
+            dilated_conv.update().specialize(DW == d && DH == d);
+        }
+    }
+
+    static constexpr int common_dilations[] = {0, 1};
+};
+
+#endif
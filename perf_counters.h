@@ -0,0 +1,225 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Hardware counters of a timed region, from perf_event_open. Halide and
+// oneDNN both run on thread pools that already exist by the time a kernel
+// is measured, so the counters are opened on every thread of the process
+// rather than inherited, and summed. Each event is opened on its own and
+// scaled by its enabled / running time, so the kernel multiplexing them
+// over fewer hardware counters only costs precision.
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    // FP_ARITH_INST_RETIRED.{SCALAR,128B,256B,512B}_PACKED_SINGLE (Intel only),
+    // weighted by their lanes: the retired single precision FLOPs
+    PERF_FP_SCALAR,
+    PERF_FP_128,
+    PERF_FP_256,
+    PERF_FP_512,
+    PERF_NUM_EVENTS
+};
+
+struct PerfSample {
+    double value[PERF_NUM_EVENTS] = {};
+    bool valid[PERF_NUM_EVENTS] = {};
+
+    bool has(PerfEvent e) const {
+        return valid[e];
+    }
+
+    // retired single precision FLOPs, if the FP_ARITH events are available
+    bool has_flops() const {
+        return valid[PERF_FP_SCALAR] && valid[PERF_FP_128] && valid[PERF_FP_256];
+    }
+
+    double flops() const {
+        return value[PERF_FP_SCALAR] + 4 * value[PERF_FP_128] + 8 * value[PERF_FP_256] +
+               (valid[PERF_FP_512] ? 16 * value[PERF_FP_512] : 0);
+    }
+
+    bool empty() const {
+        for (bool v : valid) {
+            if (v) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Sum of two regions, e.g. consecutive primitives. Adding to an empty
+    // sample copies the other one.
+    PerfSample &operator+=(const PerfSample &other) {
+        if (empty()) {
+            return *this = other;
+        }
+        for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+            value[e] += other.value[e];
+            valid[e] = valid[e] && other.valid[e];
+        }
+        return *this;
+    }
+};
+
+class PerfCounters {
+ public:
+    PerfCounters() {
+        auto cache_miss = [](uint64_t cache) {
+            return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+        configs[PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES};
+        configs[PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS};
+        configs[PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_L1D)};
+        configs[PERF_LLC_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES};
+        configs[PERF_DTLB_MISSES] = {PERF_TYPE_HW_CACHE, cache_miss(PERF_COUNT_HW_CACHE_DTLB)};
+        // raw events are model specific: only ask for them on Intel, where
+        // event 0xc7 is FP_ARITH_INST_RETIRED since Broadwell
+        const bool intel = cpu_vendor() == "GenuineIntel";
+        const uint64_t fp_umask[] = {0x02, 0x08, 0x20, 0x80};
+        for (int i = 0; i < 4; i++) {
+            configs[PERF_FP_SCALAR + i] = {intel ? PERF_TYPE_RAW : PERF_TYPE_MAX, (fp_umask[i] << 8) | 0xc7};
+        }
+    }
+
+    // Opens and enables the counters on every current thread.
+    void start() {
+        for (pid_t tid : threads()) {
+            for (int e = 0; e < PERF_NUM_EVENTS; e++) {
+                if (configs[e].type == PERF_TYPE_MAX) {
+                    continue;
+                }
+                perf_event_attr attr;
+                memset(&attr, 0, sizeof(attr));
+                attr.size = sizeof(attr);
+                attr.type = configs[e].type;
+                attr.config = configs[e].config;
+                attr.disabled = 1;
+                attr.exclude_kernel = 1;
+                attr.exclude_hv = 1;
+                attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+                int fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+                if (fd >= 0) {
+                    fds.push_back({e, fd});
+                }
+            }
+        }
+        for (const auto &f : fds) {
+            ioctl(f.fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(f.fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    // Disables and closes the counters, returning their totals. An event is
+    // valid only if it could be opened on at least one thread.
+    PerfSample stop() {
+        for (const auto &f : fds) {
+            ioctl(f.fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+        PerfSample s;
+        for (const auto &f : fds) {
+            uint64_t data[3];
+            if (read(f.fd, data, sizeof(data)) == sizeof(data) && data[2] > 0) {
+                s.value[f.event] += (double)data[0] * data[1] / data[2];
+                s.valid[f.event] = true;
+            }
+            close(f.fd);
+        }
+        fds.clear();
+        return s;
+    }
+
+ private:
+    struct Config {
+        uint32_t type;
+        uint64_t config;
+    };
+    struct OpenEvent {
+        int event, fd;
+    };
+    Config configs[PERF_NUM_EVENTS];
+    std::vector<OpenEvent> fds;
+
+    static std::vector<pid_t> threads() {
+        std::vector<pid_t> tids;
+        if (DIR *dir = opendir("/proc/self/task")) {
+            while (dirent *entry = readdir(dir)) {
+                if (entry->d_name[0] != '.') {
+                    tids.push_back(atoi(entry->d_name));
+                }
+            }
+            closedir(dir);
+        }
+        return tids;
+    }
+
+    static std::string cpu_vendor() {
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.compare(0, 9, "vendor_id") == 0) {
+                return line.substr(line.find(':') + 2);
+            }
+        }
+        return "";
+    }
+};
+
+// Per-iteration counters of `op`, run `iterations` times after the timing so
+// the thread pools are warm; call it after benchmark() on the same op.
+inline PerfSample measure_counters(const std::function<void()> &op, int iterations = 10) {
+    PerfCounters counters;
+    counters.start();
+    for (int i = 0; i < iterations; i++) {
+        op();
+    }
+    PerfSample s = counters.stop();
+    for (double &v : s.value) {
+        v /= iterations;
+    }
+    return s;
+}
+
+// Prints IPC and misses per FLOP, where `flops` is the analytic FLOP count of
+// one iteration (the one behind the GFLOP/s figures).
+inline void print_counters(const char *name, const PerfSample &s, double flops) {
+    auto per_flop = [&](PerfEvent e) {
+        static char buf[32];
+        if (!s.has(e)) {
+            return "n/a";
+        }
+        snprintf(buf, sizeof(buf), "%.5f", s.value[e] / flops);
+        return (const char *)buf;
+    };
+    printf("%s counters: ", name);
+    if (s.has(PERF_CYCLES) && s.has(PERF_INSTRUCTIONS)) {
+        printf("IPC %.2f, ", s.value[PERF_INSTRUCTIONS] / s.value[PERF_CYCLES]);
+    } else {
+        printf("IPC n/a, ");
+    }
+    printf("misses/FLOP L1D %s, ", per_flop(PERF_L1D_MISSES));
+    printf("LLC %s, ", per_flop(PERF_LLC_MISSES));
+    printf("dTLB %s", per_flop(PERF_DTLB_MISSES));
+    if (s.has_flops()) {
+        printf(", retired FP %.3f GFLOP (%.0f%% of analytic)", s.flops() / 1e9, 100 * s.flops() / flops);
+    }
+    printf("\n");
+}
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef PIPELINE_COMMON_H
+#define PIPELINE_COMMON_H
+
+#include "Halide.h"
+
+#include <functional>
+
+using namespace Halide;
+
+// Shape of a convolution layer, read from the extents of the (c, x, y, n)
+// input and (co, kw, kh, ci) filter buffers so one compiled pipeline serves
+// every layer shape. W and H are the output extents.
+struct ConvShape {
+    Expr N, CI, CO, W, H, KW, KH;
+    // input extents, stride, and zero padding on each side; only the direct
+    // conv and dilated conv pipelines support other than stride 1, unpadded
+    Expr IW, IH;
+    Expr SW = 1, SH = 1, PW = 0, PH = 0;
+};
+
+// Works for both ImageParam (JIT) and Input<Buffer<>> (generators).
+template <typename InputBuffer>
+inline ConvShape conv_shape(const InputBuffer &input, const InputBuffer &filter, Expr DW = 0, Expr DH = 0,
+                            Expr SW = 1, Expr SH = 1, Expr PW = 0, Expr PH = 0) {
+    ConvShape s;
+    s.N = input.dim(3).extent();
+    s.CI = input.dim(0).extent();
+    s.CO = filter.dim(0).extent();
+    s.KW = filter.dim(1).extent();
+    s.KH = filter.dim(2).extent();
+    s.IW = input.dim(1).extent();
+    s.IH = input.dim(2).extent();
+    s.SW = SW;
+    s.SH = SH;
+    s.PW = PW;
+    s.PH = PH;
+    s.W = (s.IW + 2 * PW - (s.KW - 1) * (DW + 1) - 1) / SW + 1;
+    s.H = (s.IH + 2 * PH - (s.KH - 1) * (DH + 1) - 1) / SH + 1;
+    return s;
+}
+
+// Whether the layer is stride 1 and unpadded, for specializations.
+inline Expr is_dense(const ConvShape &s) {
+    return s.SW == 1 && s.SH == 1 && s.PW == 0 && s.PH == 0;
+}
+
+// The input seen through zero padding, in padded coordinates: x in
+// [-PW, IW + PW). The in-bounds test is marked likely, so Halide's loop
+// partitioning splits the loops over output tiles into border iterations
+// that keep the test and an interior that runs the plain vectorized loads.
+// An unpadded layer folds the test away entirely in its specializations.
+inline Func zero_pad(Func input, const ConvShape &s) {
+    Var c("c"), x("x"), y("y"), n("n");
+    Func padded("padded");
+    Expr unpadded = s.PW == 0 && s.PH == 0;
+    Expr inside = x >= 0 && x < s.IW && y >= 0 && y < s.IH;
+    padded(c, x, y, n) = select(likely(unpadded || inside),
+                                input(c, clamp(x, 0, s.IW - 1), clamp(y, 0, s.IH - 1), n), 0.0f);
+    return padded;
+}
+
+// The conv outputs are tiled by (c_tile, tile_h) over (c, x). `schedule` is
+// applied once per specialization of `out`, from the fastest to the most
+// general:
+//  - channels and width divide the tile: no tail at all;
+//  - at least one full tile: ShiftInwards recomputes the overlap of the last
+//    tile, so the tail stays on the vector path;
+//  - fewer channels than a tile but at least one vector: single-vector tiles;
+//  - anything smaller: guarded tails.
+// Every branch uses the same loop names, so producers can compute_at them.
+// `x_dim` is the output dimension tiled by tile_h.
+inline void specialize_output_tiles(Func out, int vec, int tile_w, int tile_h,
+                                    const std::function<void(Stage, int, TailStrategy)> &schedule,
+                                    int x_dim = 1) {
+    Expr C = out.output_buffer().dim(0).extent();
+    Expr W = out.output_buffer().dim(x_dim).extent();
+    schedule(out.specialize(C % (vec * tile_w) == 0 && W % tile_h == 0), vec * tile_w, TailStrategy::ShiftInwards);
+    schedule(out.specialize(C >= vec * tile_w && W >= tile_h), vec * tile_w, TailStrategy::ShiftInwards);
+    schedule(out.specialize(C >= vec && W >= tile_h), vec, TailStrategy::ShiftInwards);
+    schedule(out, vec, TailStrategy::GuardWithIf);
+}
+
+#endif
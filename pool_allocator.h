@@ -0,0 +1,213 @@
+#ifndef POOL_ALLOCATOR_H
+#define POOL_ALLOCATOR_H
+
+#include "Halide.h"
+#include "HalideRuntime.h"
+#include "common.h"
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// halide_malloc / halide_free for the intermediates of the Halide kernels.
+// Every realize of a kernel allocates the same buffers (producers computed at
+// a tile, input.in() / filter.in() staging) and frees them before it returns,
+// so the blocks are kept in per-thread free lists of power of two size
+// classes and handed out again on the next call instead of going back to the
+// system. Halide frees every buffer on the thread that allocated it, so the
+// lists need no locking. Blocks of 2 MB and more can be backed by transparent
+// huge pages.
+//
+// take_allocator() installs it for the AOT kernels; a JIT pipeline needs
+// use_allocator(out) as well, since it runs on its own copy of the runtime.
+
+struct AllocStats {
+    uint64_t allocations = 0;         // halide_malloc calls
+    uint64_t system_allocations = 0;  // of which were not served from a pool
+    uint64_t bytes = 0;               // requested by those calls
+
+    AllocStats operator-(const AllocStats &other) const {
+        return {allocations - other.allocations, system_allocations - other.system_allocations, bytes - other.bytes};
+    }
+};
+
+class PoolAllocator {
+ public:
+    enum Mode {
+        System,    // no pooling, every call goes to the system (counted all the same)
+        Pool,      // size-class pool
+        PoolHuge,  // size-class pool, large blocks on transparent huge pages
+    };
+
+    // Halide needs its buffers aligned to 32 bytes (64 on AVX-512 targets);
+    // the block header sits in the alignment padding in front of the data.
+    static constexpr size_t alignment = 128;
+    static constexpr size_t huge_page = 2 << 20;
+    static constexpr int min_class = 6;
+    static constexpr int num_classes = 48;
+
+    static Mode &mode() {
+        static Mode m = Pool;
+        return m;
+    }
+
+    static void *allocate(void *user_context, size_t size) {
+        counters().allocations.fetch_add(1, std::memory_order_relaxed);
+        counters().bytes.fetch_add(size, std::memory_order_relaxed);
+        int size_class = min_class;
+        while (((size_t)1 << size_class) < size) {
+            size_class++;
+        }
+        if (mode() != System) {
+            std::vector<void *> &list = thread_cache().lists[size_class];
+            if (!list.empty()) {
+                void *p = list.back();
+                list.pop_back();
+                return p;
+            }
+        }
+        counters().system_allocations.fetch_add(1, std::memory_order_relaxed);
+        return system_allocate(size_class);
+    }
+
+    static void release(void *user_context, void *ptr) {
+        if (!ptr) {
+            return;
+        }
+        if (mode() == System) {
+            system_release(ptr);
+        } else {
+            thread_cache().lists[header(ptr)->size_class].push_back(ptr);
+        }
+    }
+
+    static AllocStats stats() {
+        AllocStats s;
+        s.allocations = counters().allocations.load();
+        s.system_allocations = counters().system_allocations.load();
+        s.bytes = counters().bytes.load();
+        return s;
+    }
+
+ private:
+    struct Header {
+        int size_class;
+        bool mapped;
+    };
+
+    // the blocks a thread has freed, by size class; returned to the system
+    // when the thread exits
+    struct ThreadCache {
+        std::vector<void *> lists[num_classes];
+
+        ~ThreadCache() {
+            for (auto &list : lists) {
+                for (void *p : list) {
+                    system_release(p);
+                }
+            }
+        }
+    };
+
+    struct Counters {
+        std::atomic<uint64_t> allocations{0}, system_allocations{0}, bytes{0};
+    };
+
+    static Counters &counters() {
+        static Counters c;
+        return c;
+    }
+
+    static ThreadCache &thread_cache() {
+        thread_local ThreadCache cache;
+        return cache;
+    }
+
+    static Header *header(void *ptr) {
+        return (Header *)((char *)ptr - alignment);
+    }
+
+    static void *system_allocate(int size_class) {
+        size_t bytes = ((size_t)1 << size_class) + alignment;
+        char *base;
+        bool mapped = mode() == PoolHuge && bytes >= huge_page;
+        if (mapped) {
+            bytes = (bytes + huge_page - 1) / huge_page * huge_page;
+            void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) {
+                return nullptr;
+            }
+            madvise(p, bytes, MADV_HUGEPAGE);
+            base = (char *)p;
+        } else {
+            base = (char *)aligned_alloc(alignment, bytes);
+            if (!base) {
+                return nullptr;
+            }
+        }
+        Header *h = (Header *)base;
+        h->size_class = size_class;
+        h->mapped = mapped;
+        return base + alignment;
+    }
+
+    static void system_release(void *ptr) {
+        Header *h = header(ptr);
+        if (h->mapped) {
+            size_t bytes = ((size_t)1 << h->size_class) + alignment;
+            munmap(h, (bytes + huge_page - 1) / huge_page * huge_page);
+        } else {
+            free(h);
+        }
+    }
+};
+
+inline void *pool_malloc(void *user_context, size_t size) {
+    return PoolAllocator::allocate(user_context, size);
+}
+
+inline void pool_free(void *user_context, void *ptr) {
+    PoolAllocator::release(user_context, ptr);
+}
+
+inline AllocStats alloc_stats() {
+    return PoolAllocator::stats();
+}
+
+// Reads --alloc system|pool|huge (default pool) and installs the allocator
+// for the AOT kernels.
+inline bool take_allocator(int &argc, char **argv) {
+    std::string mode = take_option(argc, argv, "--alloc", "pool");
+    if (mode == "system") {
+        PoolAllocator::mode() = PoolAllocator::System;
+    } else if (mode == "pool") {
+        PoolAllocator::mode() = PoolAllocator::Pool;
+    } else if (mode == "huge") {
+        PoolAllocator::mode() = PoolAllocator::PoolHuge;
+    } else {
+        printf("--alloc expects system, pool or huge\n");
+        return false;
+    }
+    halide_set_custom_malloc(pool_malloc);
+    halide_set_custom_free(pool_free);
+    return true;
+}
+
+// Routes the allocations of a JIT-compiled pipeline through the allocator.
+inline void use_allocator(Func f) {
+    f.set_custom_allocator(pool_malloc, pool_free);
+}
+
+inline void print_alloc_stats(const char *name, const AllocStats &per_call) {
+    printf("%s allocations per call: %llu (%llu from the system), %.1f KB\n", name,
+           (unsigned long long)per_call.allocations, (unsigned long long)per_call.system_allocations,
+           per_call.bytes / 1024.0);
+}
+
+#endif
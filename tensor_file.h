@@ -0,0 +1,223 @@
+#ifndef TENSOR_FILE_H
+#define TENSOR_FILE_H
+
+#include "Halide.h"
+#include "common.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Float tensors kept in files and memory-mapped, for layers that do not fit
+// in memory. A file is a header page followed by the elements, dense, in the
+// dimension order of the Halide buffers (the first dimension innermost), so a
+// (c, x, y, n) activation is NHWC and a band of rows of one image is one
+// contiguous range of the file:
+//
+//   offset 0     char magic[8]   "HLTENSR1"
+//          8     uint32 rank     1 to 8
+//          12    uint32 bytes    per element, 4
+//          16    int64 extents[8], unused ones 0
+//          4096  the elements
+//
+// The data starts on a page so that ranges of elements map to whole pages
+// for madvise.
+
+struct TensorFileHeader {
+    char magic[8];
+    uint32_t rank;
+    uint32_t elem_bytes;
+    int64_t extents[8];
+};
+
+static constexpr char tensor_file_magic[8] = {'H', 'L', 'T', 'E', 'N', 'S', 'R', '1'};
+static constexpr size_t tensor_file_data_offset = 4096;
+
+class MappedTensor {
+ public:
+    MappedTensor() = default;
+    MappedTensor(const MappedTensor &) = delete;
+    MappedTensor &operator=(const MappedTensor &) = delete;
+    ~MappedTensor() {
+        close();
+    }
+
+    // Maps an existing tensor file, read-only unless `writable`. Prints the
+    // reason and returns false if the file is missing or not a tensor file.
+    bool open(const std::string &path, bool writable) {
+        close();
+        int fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+        if (fd < 0) {
+            return fail(path, strerror(errno));
+        }
+        TensorFileHeader h;
+        struct stat st;
+        bool ok = pread(fd, &h, sizeof(h), 0) == sizeof(h) && fstat(fd, &st) == 0;
+        if (!ok || memcmp(h.magic, tensor_file_magic, sizeof(h.magic)) != 0 || h.rank < 1 || h.rank > 8 ||
+            h.elem_bytes != sizeof(float)) {
+            ::close(fd);
+            return fail(path, "not a float tensor file");
+        }
+        extents_.assign(h.extents, h.extents + h.rank);
+        if ((size_t)st.st_size < tensor_file_data_offset + elements() * sizeof(float)) {
+            ::close(fd);
+            return fail(path, "shorter than its header says");
+        }
+        return map(fd, path, writable);
+    }
+
+    // Creates (or truncates) `path` as a tensor of the given extents and maps
+    // it read-write. The elements start out as zeros, without touching the disk.
+    bool create(const std::string &path, const std::vector<int> &extents) {
+        close();
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return fail(path, strerror(errno));
+        }
+        TensorFileHeader h = {};
+        memcpy(h.magic, tensor_file_magic, sizeof(h.magic));
+        h.rank = extents.size();
+        h.elem_bytes = sizeof(float);
+        std::copy(extents.begin(), extents.end(), h.extents);
+        extents_.assign(extents.begin(), extents.end());
+        if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h) ||
+            ftruncate(fd, tensor_file_data_offset + elements() * sizeof(float)) != 0) {
+            ::close(fd);
+            return fail(path, strerror(errno));
+        }
+        return map(fd, path, true);
+    }
+
+    void close() {
+        if (base_) {
+            munmap(base_, size_);
+            base_ = nullptr;
+        }
+        extents_.clear();
+    }
+
+    float *data() const {
+        return (float *)((char *)base_ + tensor_file_data_offset);
+    }
+
+    const std::vector<int64_t> &extents() const {
+        return extents_;
+    }
+
+    int64_t elements() const {
+        int64_t e = 1;
+        for (int64_t x : extents_) {
+            e *= x;
+        }
+        return e;
+    }
+
+    bool has_extents(const std::vector<int> &extents) const {
+        return std::equal(extents.begin(), extents.end(), extents_.begin(), extents_.end());
+    }
+
+    // madvise on the pages holding elements [begin, end)
+    void advise(int64_t begin, int64_t end, int advice) const {
+        if (end <= begin) {
+            return;
+        }
+        const uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t first = (uintptr_t)(data() + begin) & ~(page - 1);
+        uintptr_t last = std::min((uintptr_t)(data() + end), (uintptr_t)base_ + size_);
+        madvise((void *)first, last - first, advice);
+    }
+
+    // Starts reading elements [begin, end) in the background, for a range
+    // needed soon.
+    void prefetch(int64_t begin, int64_t end) const {
+        advise(begin, end, MADV_WILLNEED);
+    }
+
+    // Touches every page of elements [begin, end), so that they are resident
+    // once it returns; run on a thread of its own next to the compute.
+    void fault_in(int64_t begin, int64_t end) const {
+        const int64_t step = sysconf(_SC_PAGESIZE) / sizeof(float);
+        volatile float sink = 0;
+        for (int64_t i = begin; i < end; i += step) {
+            sink = sink + data()[i];
+        }
+        if (end > begin) {
+            sink = sink + data()[end - 1];
+        }
+    }
+
+    // Drops the pages of elements [begin, end) that are done with. Written
+    // pages are queued for writeback first; they stay in the page cache until
+    // the kernel has written them, so nothing is lost.
+    void release(int64_t begin, int64_t end) const {
+        if (writable_) {
+            const uintptr_t page = sysconf(_SC_PAGESIZE);
+            uintptr_t first = (uintptr_t)(data() + begin) & ~(page - 1);
+            msync((void *)first, (uintptr_t)(data() + end) - first, MS_ASYNC);
+        }
+        advise(begin, end, MADV_DONTNEED);
+    }
+
+    // The whole tensor as a 4-D buffer, for the checks and the small tensors.
+    Buffer<float, 4> buffer() const {
+        return Buffer<float, 4>(data(), (int)extents_[0], (int)extents_[1], (int)extents_[2], (int)extents_[3]);
+    }
+
+ private:
+    void *base_ = nullptr;
+    size_t size_ = 0;
+    bool writable_ = false;
+    std::vector<int64_t> extents_;
+
+    bool map(int fd, const std::string &path, bool writable) {
+        size_ = tensor_file_data_offset + elements() * sizeof(float);
+        writable_ = writable;
+        base_ = mmap(nullptr, size_, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base_ == MAP_FAILED) {
+            base_ = nullptr;
+            return fail(path, strerror(errno));
+        }
+        return true;
+    }
+
+    bool fail(const std::string &path, const char *why) {
+        printf("%s: %s\n", path.c_str(), why);
+        extents_.clear();
+        return false;
+    }
+};
+
+// Fills a tensor file with random_data's values for `seed`, in chunks that
+// are written back and dropped as they are done, so the file can be larger
+// than memory.
+inline void random_data(MappedTensor &t, const RandomDistribution &dist = RandomDistribution(),
+                        uint64_t seed = next_random_seed()) {
+    const int64_t elements = t.elements();
+    const int64_t chunk = 16 << 20;
+    const int64_t threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int64_t begin = 0; begin < elements; begin += chunk) {
+        const int64_t end = std::min(elements, begin + chunk);
+        const int64_t part = ((end - begin) / threads + 4) & ~(int64_t)3;
+        std::vector<std::thread> workers;
+        for (int64_t b = begin; b < end; b += part) {
+            workers.emplace_back([&, b]() { random_fill(t.data(), b, std::min(end, b + part), dist, seed); });
+        }
+        for (auto &w : workers) {
+            w.join();
+        }
+        t.release(begin, end);
+    }
+}
+
+#endif
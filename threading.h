@@ -0,0 +1,272 @@
+#ifndef THREADING_H
+#define THREADING_H
+
+#include "HalideRuntime.h"
+#include "common.h"
+#include "oneapi/dnnl/dnnl_config.h"
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#if DNNL_CPU_THREADING_RUNTIME == DNNL_RUNTIME_OMP
+#include <omp.h>
+#endif
+
+// Thread pool sizing, core pinning and NUMA memory policy, shared by the
+// drivers. Halide and oneDNN run on separate pools (Halide's own, and
+// oneDNN's OpenMP runtime), and both default to every core of the machine,
+// not the cores the process may run on: under `srun -c 4` that oversubscribes
+// the allocation. The default thread count here is the size of the process's
+// affinity mask instead.
+
+// A logical CPU and where it sits: its socket, physical core, and its rank
+// among the hyperthreads of that core.
+struct CpuTopology {
+    int cpu, package, core, smt;
+};
+
+inline int read_sysfs_int(const std::string &path, int def) {
+    int v = def;
+    if (FILE *f = fopen(path.c_str(), "r")) {
+        if (fscanf(f, "%d", &v) != 1) {
+            v = def;
+        }
+        fclose(f);
+    }
+    return v;
+}
+
+// The CPUs of the process's affinity mask, with their topology.
+inline std::vector<CpuTopology> allowed_cpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<CpuTopology> cpus;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return cpus;
+    }
+    std::map<std::pair<int, int>, int> siblings;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set)) {
+            continue;
+        }
+        std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        int package = read_sysfs_int(topology + "physical_package_id", 0);
+        int core = read_sysfs_int(topology + "core_id", cpu);
+        cpus.push_back({cpu, package, core, siblings[{package, core}]++});
+    }
+    return cpus;
+}
+
+// The NUMA node of `cpu`, from its nodeN link in sysfs.
+inline int cpu_node(int cpu) {
+    int node = 0;
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    if (DIR *dir = opendir(path.c_str())) {
+        while (dirent *entry = readdir(dir)) {
+            if (strncmp(entry->d_name, "node", 4) == 0) {
+                node = atoi(entry->d_name + 4);
+            }
+        }
+        closedir(dir);
+    }
+    return node;
+}
+
+// Data cache sizes in bytes, per level, from the cache directories of cpu0
+// in sysfs ("48K", "2048K", "32M"); the last level is shared by the cores
+// of a socket, the others are per core. Levels sysfs does not list keep the
+// defaults.
+struct CacheSizes {
+    int l1 = 32 << 10, l2 = 1 << 20, l3 = 8 << 20;
+};
+
+inline CacheSizes cache_sizes() {
+    CacheSizes sizes;
+    for (int index = 0;; index++) {
+        std::string dir = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/";
+        int level = read_sysfs_int(dir + "level", -1);
+        if (level < 0) {
+            break;
+        }
+        char type[32] = {}, size[32] = {};
+        if (FILE *f = fopen((dir + "type").c_str(), "r")) {
+            if (fscanf(f, "%31s", type) != 1) {
+                type[0] = 0;
+            }
+            fclose(f);
+        }
+        if (FILE *f = fopen((dir + "size").c_str(), "r")) {
+            if (fscanf(f, "%31s", size) != 1) {
+                size[0] = 0;
+            }
+            fclose(f);
+        }
+        if (strcmp(type, "Instruction") == 0) {
+            continue;
+        }
+        char *unit;
+        long bytes = strtol(size, &unit, 10);
+        if (*unit == 'K') {
+            bytes <<= 10;
+        } else if (*unit == 'M') {
+            bytes <<= 20;
+        }
+        if (bytes <= 0) {
+            continue;
+        }
+        if (level == 1) {
+            sizes.l1 = bytes;
+        } else if (level == 2) {
+            sizes.l2 = bytes;
+        } else if (level == 3) {
+            sizes.l3 = bytes;
+        }
+    }
+    return sizes;
+}
+
+struct ThreadConfig {
+    int threads = 1;
+    // "none" leaves placement to the OS; "compact" fills the physical cores
+    // of one socket before the next, "scatter" alternates sockets. Either way
+    // hyperthread siblings come after every physical core.
+    std::string pin = "none";
+    // "none" keeps the default first-touch policy, "bind" allocates on the
+    // nodes of the pinned cores, "interleave" spreads pages over them
+    std::string numa = "none";
+    // allowed CPUs in the order the pinning policy uses them
+    std::vector<int> cpus;
+};
+
+// Sizes both thread pools. HL_NUM_THREADS is set as well for the JIT runtime,
+// which is a separate copy of the Halide runtime and reads it when its pool
+// starts; halide_set_num_threads resizes the pool of the AOT kernels at any
+// time. oneDNN can only be sized from here with its OpenMP runtime.
+inline void set_num_threads(int threads) {
+    setenv("HL_NUM_THREADS", std::to_string(threads).c_str(), 1);
+    halide_set_num_threads(threads);
+#if DNNL_CPU_THREADING_RUNTIME == DNNL_RUNTIME_OMP
+    omp_set_num_threads(threads);
+#endif
+}
+
+// Confines every current thread to the first `threads` CPUs of the pinning
+// order; threads created later inherit the mask of the thread that creates
+// them. The pools are confined as a set rather than one thread per CPU,
+// since their workers cannot be told apart from outside.
+inline void pin_threads(const ThreadConfig &config, int threads) {
+    if (config.pin == "none" || config.cpus.empty()) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < std::min<int>(threads, config.cpus.size()); i++) {
+        CPU_SET(config.cpus[i], &set);
+    }
+    if (DIR *dir = opendir("/proc/self/task")) {
+        while (dirent *entry = readdir(dir)) {
+            if (entry->d_name[0] != '.') {
+                sched_setaffinity(atoi(entry->d_name), sizeof(set), &set);
+            }
+        }
+        closedir(dir);
+    }
+}
+
+// Sets the memory policy of the calling thread, and of the threads it
+// creates, to the NUMA nodes of the first `threads` pinned CPUs. Call it
+// before the buffers are allocated.
+inline void set_memory_policy(const ThreadConfig &config, int threads) {
+    if (config.numa == "none") {
+        return;
+    }
+    unsigned long nodes = 0;
+    for (int i = 0; i < std::min<int>(threads, config.cpus.size()); i++) {
+        nodes |= 1ul << cpu_node(config.cpus[i]);
+    }
+    int mode = config.numa == "interleave" ? MPOL_INTERLEAVE : MPOL_BIND;
+    if (syscall(SYS_set_mempolicy, mode, &nodes, 8 * sizeof(nodes)) != 0) {
+        printf("set_mempolicy failed, using the default policy\n");
+    }
+}
+
+// Runs the next measurement on `threads` threads.
+inline void use_threads(const ThreadConfig &config, int threads) {
+    set_num_threads(threads);
+    pin_threads(config, threads);
+}
+
+// Reads --threads N (default HL_NUM_THREADS, else the size of the affinity
+// mask), --pin none|compact|scatter and --numa none|bind|interleave, and
+// applies them. Call it first thing in main, before any buffer or pool exists.
+inline bool take_threading(int &argc, char **argv, ThreadConfig &config) {
+    const char *env_threads = getenv("HL_NUM_THREADS");
+    config.threads = atoi(take_option(argc, argv, "--threads", env_threads ? env_threads : "0"));
+    config.pin = take_option(argc, argv, "--pin", "none");
+    config.numa = take_option(argc, argv, "--numa", "none");
+    if (config.pin != "none" && config.pin != "compact" && config.pin != "scatter") {
+        printf("--pin expects none, compact or scatter\n");
+        return false;
+    }
+    if (config.numa != "none" && config.numa != "bind" && config.numa != "interleave") {
+        printf("--numa expects none, bind or interleave\n");
+        return false;
+    }
+
+    std::vector<CpuTopology> cpus = allowed_cpus();
+    std::map<std::pair<int, int>, int> core_rank;
+    std::map<int, int> cores_in_package;
+    for (const CpuTopology &t : cpus) {
+        if (t.smt == 0) {
+            core_rank[{t.package, t.core}] = cores_in_package[t.package]++;
+        }
+    }
+    auto order = [&](const CpuTopology &t) {
+        int rank = core_rank[{t.package, t.core}];
+        return config.pin == "scatter" ? std::make_tuple(t.smt, rank, t.package)
+                                       : std::make_tuple(t.smt, t.package, rank);
+    };
+    std::stable_sort(cpus.begin(), cpus.end(), [&](const CpuTopology &a, const CpuTopology &b) {
+        return order(a) < order(b);
+    });
+    config.cpus.clear();
+    for (const CpuTopology &t : cpus) {
+        config.cpus.push_back(t.cpu);
+    }
+    if (config.threads <= 0) {
+        config.threads = std::max<int>(1, config.cpus.size());
+    }
+
+    set_memory_policy(config, config.threads);
+    use_threads(config, config.threads);
+    return true;
+}
+
+inline void print_threading(const ThreadConfig &config) {
+    printf("threads: %d of %zu CPUs, pin %s, numa %s\n", config.threads, config.cpus.size(),
+           config.pin.c_str(), config.numa.c_str());
+}
+
+// Thread counts of a scaling sweep: powers of two up to `max`, and `max`.
+inline std::vector<int> scaling_thread_counts(int max) {
+    std::vector<int> counts;
+    for (int t = 1; t < max; t *= 2) {
+        counts.push_back(t);
+    }
+    counts.push_back(max);
+    return counts;
+}
+
+#endif
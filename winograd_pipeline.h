@@ -0,0 +1,193 @@
+#ifndef WINOGRAD_PIPELINE_H
+#define WINOGRAD_PIPELINE_H
+
+#include "Halide.h"
+#include "pipeline_common.h"
+
+#include <vector>
+
+using namespace Halide;
+
+// Winograd F(m x m, 3 x 3) convolution for stride 1, no padding, m = 2 or 4.
+// Each m x m output tile is computed from a t x t input tile (t = m + 2) as
+//   Y = A^T [ (G g G^T) .* (B^T d B) ] A
+// where the elementwise product is summed over CI: one small GEMM per
+// transform coefficient. The filter transform U = G g G^T only depends on the
+// weights, so it is a separate pipeline whose output is computed once and
+// passed to every call of the conv pipeline.
+struct WinogradMatrices {
+    int m, t;
+    std::vector<std::vector<float>> BT, G, AT;
+
+    explicit WinogradMatrices(int m) : m(m), t(m + 2) {
+        if (m == 2) {
+            BT = {{1, 0, -1, 0},
+                  {0, 1, 1, 0},
+                  {0, -1, 1, 0},
+                  {0, 1, 0, -1}};
+            G = {{1, 0, 0},
+                 {0.5f, 0.5f, 0.5f},
+                 {0.5f, -0.5f, 0.5f},
+                 {0, 0, 1}};
+            AT = {{1, 1, 1, 0},
+                  {0, 1, -1, -1}};
+        } else {
+            BT = {{4, 0, -5, 0, 1, 0},
+                  {0, -4, -4, 1, 1, 0},
+                  {0, 4, -4, -1, 1, 0},
+                  {0, -2, -1, 2, 1, 0},
+                  {0, 2, -1, -2, 1, 0},
+                  {0, 4, 0, -5, 0, 1}};
+            G = {{1 / 4.f, 0, 0},
+                 {-1 / 6.f, -1 / 6.f, -1 / 6.f},
+                 {-1 / 6.f, 1 / 6.f, -1 / 6.f},
+                 {1 / 24.f, 1 / 12.f, 1 / 6.f},
+                 {1 / 24.f, -1 / 12.f, 1 / 6.f},
+                 {0, 0, 1}};
+            AT = {{1, 1, 1, 1, 1, 0},
+                  {0, 1, -1, 2, -2, 0},
+                  {0, 1, 1, 4, 4, 0},
+                  {0, 1, -1, 8, -8, 1}};
+        }
+    }
+};
+
+// Applies `mat` along one dimension: row `row` of the result is
+// sum_k mat[row][k] * f(k). The rows are muxed on `row`, so once the loop over
+// it is unrolled every coefficient is a constant and the zeros and ones fold.
+inline Expr winograd_transform(Expr row, const std::vector<std::vector<float>> &mat,
+                               const std::function<Expr(int)> &f) {
+    std::vector<Expr> rows;
+    for (const auto &coeffs : mat) {
+        Expr e = 0.0f;
+        for (size_t k = 0; k < coeffs.size(); k++) {
+            if (coeffs[k] == 1) {
+                e += f(k);
+            } else if (coeffs[k] == -1) {
+                e -= f(k);
+            } else if (coeffs[k] != 0) {
+                e += coeffs[k] * f(k);
+            }
+        }
+        rows.push_back(e);
+    }
+    return mux(row, rows);
+}
+
+// U(co, a, b, ci) = (G g G^T)(a, b) for every (co, ci) of a 3 x 3 filter.
+class WinogradFilterPipeline {
+ public:
+    Var co{"co"}, ci{"ci"}, a{"a"}, b{"b"}, kh{"kh"};
+    Func filter_x{"filter_x"}, out{"out"};
+
+    void define(Func filter, int m) {
+        WinogradMatrices w(m);
+        filter_x(co, a, kh, ci) = winograd_transform(a, w.G, [&](int kw) { return filter(co, kw, kh, ci); });
+        out(co, a, b, ci) = winograd_transform(b, w.G, [&](int kh) { return filter_x(co, a, kh, ci); });
+    }
+
+    void schedule(const Target &target) {
+        const int vec = target.natural_vector_size<float>();
+        out.reorder(co, a, b, ci)
+            .vectorize(co, vec, TailStrategy::GuardWithIf)
+            .unroll(a)
+            .unroll(b)
+            .parallel(ci);
+    }
+};
+
+// Layer shape of a Winograd conv from its input and transformed filter.
+template <typename InputBuffer>
+inline ConvShape winograd_shape(const InputBuffer &input, const InputBuffer &U) {
+    ConvShape s;
+    s.N = input.dim(3).extent();
+    s.CI = input.dim(0).extent();
+    s.CO = U.dim(0).extent();
+    s.KW = 3;
+    s.KH = 3;
+    s.W = input.dim(1).extent() - 2;
+    s.H = input.dim(2).extent() - 2;
+    return s;
+}
+
+class WinogradConvPipeline {
+ public:
+    Var x{"x"}, y{"y"}, c{"c"}, n{"n"};
+    Var a{"a"}, b{"b"}, v{"v"}, i{"i"}, j{"j"}, tx{"tx"}, ty{"ty"};
+    Var co{"co"}, ci{"ci"}, xi{"xi"}, yi{"yi"}, coo{"coo"}, txo{"txo"}, txi{"txi"};
+    Func input_x{"input_x"}, V{"V"}, M{"M"}, output_x{"output_x"}, Y{"Y"}, out{"out"};
+    Func input, U;
+    RDom r;
+    int m;
+
+    // U is the output of WinogradFilterPipeline for the same m.
+    void define(Func input, Func U, const ConvShape &shape, int m) {
+        this->input = input;
+        this->U = U;
+        this->m = m;
+        WinogradMatrices w(m);
+        r = RDom(0, shape.CI);
+
+        // input tiles past the right/bottom edge (when m does not divide the
+        // output) are clamped; their outputs are never stored
+        Expr in_w = shape.W + 2, in_h = shape.H + 2;
+        auto d = [&](Expr c, Expr x, Expr y, Expr n) {
+            return input(c, min(x, in_w - 1), min(y, in_h - 1), n);
+        };
+
+        // V = B^T d B, one pass per dimension
+        input_x(c, a, v, tx, ty, n) = winograd_transform(a, w.BT, [&](int u) { return d(c, tx * m + u, ty * m + v, n); });
+        V(c, a, b, tx, ty, n) = winograd_transform(b, w.BT, [&](int v) { return input_x(c, a, v, tx, ty, n); });
+
+        // one CO x CI by CI x tiles GEMM per transform coefficient (a, b)
+        M(c, a, b, tx, ty, n) = 0.0f;
+        M(c, a, b, tx, ty, n) += U(c, a, b, r) * V(r, a, b, tx, ty, n);
+
+        // Y = A^T M A
+        output_x(c, i, b, tx, ty, n) = winograd_transform(i, w.AT, [&](int a) { return M(c, a, b, tx, ty, n); });
+        Y(c, i, j, tx, ty, n) = winograd_transform(j, w.AT, [&](int b) { return output_x(c, i, b, tx, ty, n); });
+
+        out(c, x, y, n) = Y(c, x % m, y % m, x / m, y / m, n);
+    }
+
+    void schedule(const Target &target) {
+        const int vec = target.natural_vector_size<float>();
+        const int tile_w = 2;
+        const int tile_tx = 4;
+
+        // one row of output tiles per parallel task; with xi and yi unrolled
+        // the x % m, x / m indexing folds away
+        out.split(x, tx, xi, m, TailStrategy::GuardWithIf)
+            .split(y, ty, yi, m, TailStrategy::GuardWithIf)
+            .split(c, co, ci, vec, TailStrategy::GuardWithIf)
+            .reorder(ci, xi, yi, tx, co, ty, n)
+            .vectorize(ci)
+            .unroll(xi)
+            .unroll(yi)
+            .parallel(ty)
+            .parallel(n);
+
+        // transformed input of the tile row
+        V.compute_at(out, ty)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .unroll(a)
+            .unroll(b);
+        input_x.compute_at(V, tx)
+            .vectorize(c, vec, TailStrategy::GuardWithIf)
+            .unroll(a)
+            .unroll(v);
+
+        // the per-coefficient GEMMs, register-blocked over channels and tiles
+        M.compute_at(out, ty)
+            .vectorize(c, vec, TailStrategy::GuardWithIf);
+        M.update()
+            .split(c, coo, co, vec * tile_w, TailStrategy::GuardWithIf)
+            .split(tx, txo, txi, tile_tx, TailStrategy::GuardWithIf)
+            .reorder(co, txi, r, txo, a, b, coo, ty, n)
+            .vectorize(co, vec)
+            .unroll(co)
+            .unroll(txi);
+    }
+};
+
+#endif